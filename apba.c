@@ -19,10 +19,14 @@
 #include <linux/interrupt.h>
 #include <linux/irq.h>
 #include <linux/kfifo.h>
+#include <linux/ktime.h>
+#include <linux/miscdevice.h>
 #include <linux/module.h>
 #include <linux/mutex.h>
 #include <linux/platform_device.h>
+#include <linux/poll.h>
 #include <linux/slab.h>
+#include <linux/uaccess.h>
 #include <linux/of.h>
 #include <linux/of_gpio.h>
 #include <linux/of_platform.h>
@@ -135,6 +139,39 @@ struct apba_seq {
 	size_t len;
 };
 
+enum apba_flash_state {
+	APBA_FLASH_IDLE,
+	APBA_FLASH_RUNNING,
+	APBA_FLASH_DONE,
+	APBA_FLASH_FAILED,
+	APBA_FLASH_CANCELLED,
+};
+
+static const char * const apba_flash_state_names[] = {
+	[APBA_FLASH_IDLE]	= "idle",
+	[APBA_FLASH_RUNNING]	= "running",
+	[APBA_FLASH_DONE]	= "done",
+	[APBA_FLASH_FAILED]	= "failed",
+	[APBA_FLASH_CANCELLED]	= "cancelled",
+};
+
+/* Number of records kept for the UniPro stats stream, power of 2 */
+#define APBA_STATS_RING_SIZE	(256)
+#define APBA_STATS_PERIOD_DEF	(5000) /* ms */
+#define APBA_STATS_PERIOD_MIN	(10) /* ms */
+
+/*
+ * Binary record returned by reads of /dev/apba_unipro_stats. The counters
+ * are the deltas APBA reported in one stats response or notification, and
+ * dropped is the number of records lost to ring overflow before this one.
+ */
+struct apba_unipro_stats_rec {
+	uint64_t timestamp_ns;
+	uint32_t seq;
+	uint32_t dropped;
+	struct mhb_unipro_stats stats;
+} __attribute__((packed));
+
 struct apba_ctrl {
 	struct device *dev;
 	struct clk *mclk;
@@ -163,7 +200,6 @@ struct apba_ctrl {
 	void *mods_uart;
 	int desired_on;
 	int on;
-	struct mutex log_mutex;
 	struct completion comp;
 	struct completion apbe_log_comp;
 	struct completion baud_comp;
@@ -184,6 +220,26 @@ struct apba_ctrl {
 	struct workqueue_struct *wq;
 	struct mhb_diag_id_not apba_ids;
 	struct mhb_diag_id_not apbe_ids;
+
+	/* UniPro stats polling while the stats stream is open */
+	unsigned int stats_period_ms;
+	struct delayed_work stats_work;
+
+	/* serializes flashing and erasing of the partitions */
+	struct mutex mtd_lock;
+
+	/* background flashing requested through flash_file */
+	struct mutex flash_lock;
+	struct work_struct flash_work;
+	char flash_fw_name[APBA_FIRMWARE_NAME_LEN];
+	enum apba_flash_state flash_state;
+	int flash_result;
+	atomic_t flash_cancel;
+	uint64_t flash_done;	/* bytes of the partition checked */
+	uint64_t flash_total;
+	uint64_t flash_written;	/* bytes of the partition rewritten */
+	ktime_t flash_start;
+	ktime_t flash_end;
 } *g_ctrl;
 
 #define APBA_LOG_SIZE	SZ_16K
@@ -192,9 +248,72 @@ static DEFINE_KFIFO(apba_log_fifo, char, APBA_LOG_SIZE);
 #define APBE_LOG_SIZE	SZ_16K
 static DEFINE_KFIFO(apbe_log_fifo, char, APBE_LOG_SIZE);
 
+/*
+ * UniPro stats stream.  It is static like the log streams so that an open
+ * file outlives the controller; ctrl is only used to start and stop polling
+ * and is cleared under lock when the controller goes away.
+ */
+struct apba_stats_stream {
+	struct mutex lock;		/* protects ctrl */
+	struct apba_ctrl *ctrl;
+	spinlock_t ring_lock;
+	wait_queue_head_t wq;
+	struct apba_unipro_stats_rec ring[APBA_STATS_RING_SIZE];
+	unsigned int head;
+	unsigned int tail;
+	uint32_t seq;
+	uint32_t dropped;
+	atomic_t open;
+};
+
+static struct apba_stats_stream apba_stats_stream = {
+	.lock = __MUTEX_INITIALIZER(apba_stats_stream.lock),
+	.ring_lock = __SPIN_LOCK_UNLOCKED(apba_stats_stream.ring_lock),
+	.wq = __WAIT_QUEUE_HEAD_INITIALIZER(apba_stats_stream.wq),
+};
+
 /* used as temporary buffer to pop out content from FIFOs */
 static char fifo_overflow[MHB_MAX_MSG_SIZE];
 
+/*
+ * Blocking, pollable reader of a log FIFO.  Like the stats stream it is
+ * static, so files left open across apba_ctrl_remove() only see live go
+ * false and get -ENODEV.
+ */
+struct apba_log_stream {
+	struct mutex lock;	/* protects fifo, dropped and live */
+	struct kfifo *fifo;
+	wait_queue_head_t wq;
+	atomic_t open;
+	bool live;		/* the controller is bound */
+	unsigned long dropped;	/* bytes discarded on overflow */
+	struct miscdevice misc;
+};
+
+static const struct file_operations apba_log_fops;
+
+static struct apba_log_stream apba_log_stream = {
+	.lock = __MUTEX_INITIALIZER(apba_log_stream.lock),
+	.fifo = (struct kfifo *)&apba_log_fifo,
+	.wq = __WAIT_QUEUE_HEAD_INITIALIZER(apba_log_stream.wq),
+	.misc = {
+		.minor = MISC_DYNAMIC_MINOR,
+		.name = "apba_log",
+		.fops = &apba_log_fops,
+	},
+};
+
+static struct apba_log_stream apbe_log_stream = {
+	.lock = __MUTEX_INITIALIZER(apbe_log_stream.lock),
+	.fifo = (struct kfifo *)&apbe_log_fifo,
+	.wq = __WAIT_QUEUE_HEAD_INITIALIZER(apbe_log_stream.wq),
+	.misc = {
+		.minor = MISC_DYNAMIC_MINOR,
+		.name = "apbe_log",
+		.fops = &apba_log_fops,
+	},
+};
+
 #define APBA_LOG_REQ_TIMEOUT	1000 /* ms */
 #define APBE_LOG_REQ_TIMEOUT	1000 /* ms */
 #define APBA_MODE_REQ_TIMEOUT	1000 /* ms */
@@ -278,8 +397,9 @@ int apba_send_pm_wake_rsp(void)
 	rsp_hdr.addr = MHB_ADDR_PM;
 	rsp_hdr.type = MHB_TYPE_PM_WAKE_RSP;
 
-	ret = mods_uart_send(g_ctrl->mods_uart, &rsp_hdr, NULL, 0,
-		UART_PM_FLAG_WAKE_ACK);
+	/* Called from the wake ISR thread, so do not wait for the send */
+	ret = mods_uart_send_async(g_ctrl->mods_uart, &rsp_hdr, NULL, 0,
+		UART_PM_FLAG_WAKE_ACK, NULL, NULL);
 	if (ret)
 		pr_err("%s: failed to send\n", __func__);
 
@@ -318,8 +438,9 @@ static int apba_send_pm_sleep_rsp(void)
 	rsp_hdr.addr = MHB_ADDR_PM;
 	rsp_hdr.type = MHB_TYPE_PM_SLEEP_RSP;
 
-	ret = mods_uart_send(g_ctrl->mods_uart, &rsp_hdr, NULL, 0,
-		UART_PM_FLAG_SLEEP_ACK);
+	/* Called from UART RX, which must not block behind a wake handshake */
+	ret = mods_uart_send_async(g_ctrl->mods_uart, &rsp_hdr, NULL, 0,
+		UART_PM_FLAG_SLEEP_ACK, NULL, NULL);
 	if (ret)
 		pr_err("%s: failed to send\n", __func__);
 
@@ -506,12 +627,53 @@ static int apba_send_unipro_stats_req(void)
 	return ret;
 }
 
+/* Timestamp a stats sample into the stream ring, dropping the oldest */
+static void apba_stats_record(uint8_t *payload, size_t len)
+{
+	struct apba_stats_stream *stream = &apba_stats_stream;
+	struct apba_unipro_stats_rec *rec;
+	unsigned long flags;
+	uint32_t *src = (uint32_t *)payload;
+	uint32_t *dst;
+	size_t i;
+
+	if (!atomic_read(&stream->open))
+		return;
+
+	spin_lock_irqsave(&stream->ring_lock, flags);
+
+	if (stream->head - stream->tail >= APBA_STATS_RING_SIZE) {
+		stream->tail++;
+		stream->dropped++;
+	}
+
+	rec = &stream->ring[stream->head & (APBA_STATS_RING_SIZE - 1)];
+	memset(rec, 0, sizeof(*rec));
+	rec->timestamp_ns = ktime_to_ns(ktime_get());
+	rec->seq = stream->seq++;
+	rec->dropped = stream->dropped;
+	stream->dropped = 0;
+
+	dst = (uint32_t *)&rec->stats;
+	len = min(len, sizeof(rec->stats)) / sizeof(uint32_t);
+	for (i = 0; i < len; i++)
+		dst[i] = le32_to_cpu(src[i]);
+
+	stream->head++;
+
+	spin_unlock_irqrestore(&stream->ring_lock, flags);
+
+	wake_up_interruptible(&stream->wq);
+}
+
 static void apba_handle_unipro_stats_not(struct mhb_hdr *hdr,
                 uint8_t *payload, size_t len)
 {
         uint32_t *src = (uint32_t *)payload;
         uint32_t *dst = g_ctrl->unipro_stats;
 
+        apba_stats_record(payload, len);
+
         len = min(len, sizeof(g_ctrl->unipro_stats));
         len /= sizeof(uint32_t);
 
@@ -559,21 +721,26 @@ static void apba_handle_unipro_message(struct mhb_hdr *hdr, uint8_t *payload,
 }
 
 /* Diag */
-static void save_log_data(struct kfifo *fifo, uint8_t *payload, size_t len)
+static void save_log_data(struct apba_log_stream *stream, uint8_t *payload,
+		size_t len)
 {
+	struct kfifo *fifo = stream->fifo;
 	int overflow;
 
-	mutex_lock(&g_ctrl->log_mutex);
+	mutex_lock(&stream->lock);
 
 	overflow = kfifo_len(fifo) + len - kfifo_size(fifo);
 	if (overflow > 0) {
 		/* pop out from older content if buffer is full */
 		overflow = kfifo_out(fifo, fifo_overflow,
 				     min(overflow, MHB_MAX_MSG_SIZE));
+		stream->dropped += overflow;
 	}
-	kfifo_in(fifo, payload, len);
+	stream->dropped += len - kfifo_in(fifo, payload, len);
+
+	mutex_unlock(&stream->lock);
 
-	mutex_unlock(&g_ctrl->log_mutex);
+	wake_up_interruptible(&stream->wq);
 }
 
 static void apba_handle_diag_mode_rsp(struct mhb_hdr *hdr, uint8_t *payload,
@@ -607,13 +774,11 @@ static void apba_handle_diag_message(struct mhb_hdr *hdr, uint8_t *payload,
 	case MHB_TYPE_DIAG_LOG_RSP:
 	case MHB_TYPE_DIAG_LOG_NOT:
 		if (hdr->addr == MHB_ADDR_DIAG) {
-			save_log_data((struct kfifo *)&apba_log_fifo,
-				      payload, len);
+			save_log_data(&apba_log_stream, payload, len);
 			if (!completion_done(&g_ctrl->comp))
 				complete(&g_ctrl->comp);
 		} else if (hdr->addr == MHB_ADDR_PEER_DIAG) {
-			save_log_data((struct kfifo *)&apbe_log_fifo,
-				      payload, len);
+			save_log_data(&apbe_log_stream, payload, len);
 			if (!completion_done(&g_ctrl->apbe_log_comp))
 				complete(&g_ctrl->apbe_log_comp);
 		}
@@ -1029,7 +1194,9 @@ static ssize_t erase_partition_store(struct device *dev,
 	partition[partition_name_sz] = 0;
 	pr_debug("%s: partition=%s\n", __func__, partition);
 
+	mutex_lock(&ctrl->mtd_lock);
 	err = apba_erase_partition(ctrl, partition);
+	mutex_unlock(&ctrl->mtd_lock);
 	if (err < 0)
 		pr_err("%s: flashing erase err=%d\n", __func__, err);
 
@@ -1039,94 +1206,96 @@ static ssize_t erase_partition_store(struct device *dev,
 static DEVICE_ATTR_WO(erase_partition);
 
 /*
- * This function will compare the entire contents of the firmware file
- * described by fw against the flash contents read from the mtd device,
- * comparing one page at a time.
- * The flash contents will have two FFFF headers prepended before the TFTF
- * header, so this function reads from the flash after the FFFF headers.
+ * Read the TFTF header of the firmware currently in flash (after the two
+ * FFFF headers), record its version and compare it against the firmware
+ * file described by fw.
  *
- * Return 0 if the firmware does not need to be flashed
- * Return !0 otherwise
+ * Return true if the flashed firmware is newer and must not be replaced.
  */
-static int apba_compare_partition(struct apba_ctrl *ctrl,
+static bool apba_flashed_is_newer(struct apba_ctrl *ctrl,
 	struct mtd_info *mtd_info,
 	const struct firmware *fw)
 {
-	int err;
 	tftf_header *fsfw = (tftf_header *)fw->data;
-	unsigned long fwsize = fw->size;
 	tftf_header *tftf;
-	void *buf;
 	size_t retlen = 0;
-	/* Assume different */
-	int compare_result = 1;
-	unsigned long cur = 0;
-	size_t readlen;
+	bool newer = false;
+	int err;
 
-	tftf = kmalloc(PAGE_SIZE, GFP_KERNEL);
+	tftf = kmalloc(TFTF_HEADER_SIZE, GFP_KERNEL);
 	if (!tftf)
-		goto skip_compare;
+		return false;
 
-	buf = kmalloc(PAGE_SIZE, GFP_KERNEL);
-	if (!buf)
+	err = mtd_read(mtd_info, TFTF_OFFSET, TFTF_HEADER_SIZE, &retlen,
+		       (u_char *)tftf);
+	if (err < 0 || retlen < TFTF_HEADER_SIZE) {
+		pr_err("%s: mtd_read failure. err:%d, retlen:%zd\n",
+		       __func__, err, retlen);
 		goto cleanup;
-
-	while (cur < fwsize) {
-		readlen = min(fwsize - cur, PAGE_SIZE);
-
-		compare_result = 1;
-		err = mtd_read(mtd_info, TFTF_OFFSET + cur, readlen,
-			       &retlen, buf);
-		if (err < 0 || retlen < readlen) {
-			pr_err("%s: mtd_read failure. err:%d, retlen:%zd\n",
-			       __func__, err, retlen);
-			goto cleanup;
-		}
-
-		/* Store away the page w/ TFTF header for later check */
-		if (cur == 0)
-			memcpy(tftf, buf, readlen);
-
-		compare_result = memcmp(buf, fw->data + cur, readlen);
-
-		if (compare_result)
-			break;
-
-		cur += readlen;
 	}
 
 	/* log header values only if header sentinal is valid */
 	if (memcmp(tftf->sentinel, TFTF_SENTINEL, TFTF_SENTINEL_LENGTH)) {
 		pr_debug("%s: flashed sentinel value not valid\n", __func__);
-	} else {
-		pr_debug("%s: flashed ts %s name %s type %d mid: %08x pid: %08x"\
-			 " ara vid: %08x ara pid: %08x version %08x\n", __func__,
-			 tftf->timestamp, tftf->name, tftf->package_type,
-			 tftf->unipro_mid, tftf->unipro_pid,
-			 tftf->ara_vid, tftf->ara_pid, tftf->version);
-
-		ctrl->fw_version = tftf->version;
-		strlcpy(ctrl->fw_package_name, tftf->name, TFTF_NAME_LENGTH);
-
-		/* don't overwrite newer fw with older fw */
-		if (tftf->version > fsfw->version) {
-			compare_result = 0;
-			goto cleanup;
-		}
+		goto cleanup;
 	}
 
+	pr_debug("%s: flashed ts %s name %s type %d mid: %08x pid: %08x"\
+		 " ara vid: %08x ara pid: %08x version %08x\n", __func__,
+		 tftf->timestamp, tftf->name, tftf->package_type,
+		 tftf->unipro_mid, tftf->unipro_pid,
+		 tftf->ara_vid, tftf->ara_pid, tftf->version);
+
+	ctrl->fw_version = tftf->version;
+	strlcpy(ctrl->fw_package_name, tftf->name, TFTF_NAME_LENGTH);
+
+	/* don't overwrite newer fw with older fw */
+	newer = tftf->version > fsfw->version;
+
 	pr_debug("%s: file ts %s name %s type %d mid: %08x pid: %08x"\
-		 " ara vid: %08x ara pid: %08x version: %08x comp: %d\n",
+		 " ara vid: %08x ara pid: %08x version: %08x newer: %d\n",
 		__func__, fsfw->timestamp, fsfw->name, fsfw->package_type,
 		fsfw->unipro_mid, fsfw->unipro_pid,
-		fsfw->ara_vid, fsfw->ara_pid, fsfw->version, compare_result);
+		fsfw->ara_vid, fsfw->ara_pid, fsfw->version, newer);
 
 cleanup:
 	kfree(tftf);
-	kfree(buf);
 
-skip_compare:
-	return compare_result;
+	return newer;
+}
+
+/*
+ * Return the image length recorded in the FFFF header currently in flash,
+ * or the partition size if there is no valid header.
+ */
+static uint64_t apba_flashed_image_length(struct mtd_info *mtd_info)
+{
+	ffff_header *header;
+	size_t retlen = 0;
+	uint64_t length = mtd_info->size;
+	int err;
+
+	header = kmalloc(FFFF_HEADER_SIZE, GFP_KERNEL);
+	if (!header)
+		return length;
+
+	err = mtd_read(mtd_info, 0, FFFF_HEADER_SIZE, &retlen,
+		       (u_char *)header);
+	if (err < 0 || retlen < FFFF_HEADER_SIZE)
+		goto cleanup;
+
+	if (memcmp(header->leading_sentinel, FFFF_SENTINEL,
+		   FFFF_SENTINEL_LENGTH) ||
+	    memcmp(header->trailing_sentinel, FFFF_SENTINEL,
+		   FFFF_SENTINEL_LENGTH))
+		goto cleanup;
+
+	length = min_t(uint64_t, header->flash_image_length, mtd_info->size);
+
+cleanup:
+	kfree(header);
+
+	return length;
 }
 
 static void construct_ffff_header(ffff_header *header,
@@ -1164,17 +1333,142 @@ static void construct_ffff_header(ffff_header *header,
 		sizeof(header->trailing_sentinel));
 }
 
+/*
+ * Fill buf with len bytes of the flash image starting at offset off. The
+ * image is two copies of the FFFF header followed by the firmware file,
+ * anything past its end reads as erased flash.
+ *
+ * Return the number of bytes in buf which belong to the image.
+ */
+static size_t apba_fill_image(u_char *buf, uint64_t off, size_t len,
+	const void *header, const struct firmware *fw)
+{
+	uint64_t image_len = TFTF_OFFSET + fw->size;
+	size_t pos = 0;
+
+	memset(buf, 0xff, len);
+
+	while (pos < len && off + pos < image_len) {
+		uint64_t cur = off + pos;
+		size_t s;
+
+		if (cur < TFTF_OFFSET) {
+			size_t hdr_off = cur % FFFF_HEADER_SIZE;
+
+			s = min_t(size_t, len - pos, FFFF_HEADER_SIZE - hdr_off);
+			memcpy(buf + pos, header + hdr_off, s);
+		} else {
+			size_t fw_off = cur - TFTF_OFFSET;
+
+			s = min_t(size_t, len - pos, fw->size - fw_off);
+			memcpy(buf + pos, fw->data + fw_off, s);
+		}
+
+		pos += s;
+	}
+
+	return pos;
+}
+
+/*
+ * Bring the partition in line with the image one erase block at a time.
+ * Each block is read back and compared with the expected contents, only
+ * the blocks which differ are erased and rewritten, in a single write of
+ * as many pages as the block holds image data for. Blocks past the end
+ * of the new image that held the previous one are erased.
+ *
+ * Return the number of blocks rewritten, or a negative error.
+ */
+static int apba_flash_blocks(struct apba_ctrl *ctrl,
+	struct mtd_info *mtd_info, const void *header,
+	const struct firmware *fw)
+{
+	uint32_t erasesize = mtd_info->erasesize;
+	uint64_t image_len = TFTF_OFFSET + fw->size;
+	uint64_t end;
+	uint64_t off;
+	u_char *expect;
+	u_char *actual;
+	size_t retlen;
+	int rewritten = 0;
+	int err = 0;
+
+	end = max(image_len, apba_flashed_image_length(mtd_info));
+	end = div_u64(end + erasesize - 1, erasesize) * erasesize;
+	end = min_t(uint64_t, end, mtd_info->size);
+
+	ctrl->flash_total = end;
+	ctrl->flash_done = 0;
+	ctrl->flash_written = 0;
+
+	expect = kmalloc(erasesize, GFP_KERNEL);
+	actual = kmalloc(erasesize, GFP_KERNEL);
+	if (!expect || !actual) {
+		err = -ENOMEM;
+		goto free_mem;
+	}
+
+	for (off = 0; off < end; off += erasesize) {
+		size_t used;
+
+		/*
+		 * Cancel is only honoured before the first erase, once the
+		 * partition has been touched the image is always completed.
+		 */
+		if (!rewritten && atomic_read(&ctrl->flash_cancel)) {
+			err = -ECANCELED;
+			goto free_mem;
+		}
+
+		ctrl->flash_done = off;
+		used = apba_fill_image(expect, off, erasesize, header, fw);
+
+		retlen = 0;
+		err = mtd_read(mtd_info, off, erasesize, &retlen, actual);
+		if (err >= 0 && retlen == erasesize &&
+		    !memcmp(expect, actual, erasesize))
+			continue;
+
+		err = apba_mtd_erase(mtd_info, off, erasesize);
+		if (err < 0) {
+			pr_err("%s: erase error %d at 0x%llx\n",
+				__func__, err, off);
+			goto free_mem;
+		}
+
+		used = roundup(used, mtd_info->writesize);
+		if (used) {
+			err = mtd_write(mtd_info, off, used, &retlen, expect);
+			if (err < 0) {
+				pr_err("%s: write error %d at 0x%llx\n",
+					__func__, err, off);
+				goto free_mem;
+			}
+		}
+
+		rewritten++;
+		ctrl->flash_written += erasesize;
+	}
+
+	ctrl->flash_done = end;
+
+	pr_info("%s: rewrote %d of %llu blocks\n", __func__, rewritten,
+		div_u64(end, erasesize));
+	err = rewritten;
+
+free_mem:
+	kfree(actual);
+	kfree(expect);
+
+	return err;
+}
+
 static int apba_flash_partition(struct apba_ctrl *ctrl,
 	const char *partition, const struct firmware *fw)
 {
 	struct mtd_info *mtd_info;
 	int err;
-	size_t retlen = 0;
-	int compare_result;
 	void *buffer;
-	const void *data;
-	int offset;
-	size_t count;
 
 	if (!fw || !ctrl)
 		return -EINVAL;
@@ -1185,6 +1479,10 @@ static int apba_flash_partition(struct apba_ctrl *ctrl,
 		return -EINVAL;
 	}
 
+	/* The APBA is only taken down once the firmware is loaded and valid */
+	if (atomic_read(&ctrl->flash_cancel))
+		return -ECANCELED;
+
 	/* Disable the APBA so that it does not access the flash. */
 	apba_on(ctrl, false);
 
@@ -1198,23 +1496,15 @@ static int apba_flash_partition(struct apba_ctrl *ctrl,
 		goto no_mtd;
 	}
 
-	/* Before erasing and flashing, compare the firmware and the partition
-	 * If they match, skip the process.  If anything fails during the
-	 * comparison, then flash.
-	 */
-	compare_result = apba_compare_partition(ctrl, mtd_info, fw);
-	if (compare_result == 0) {
-		pr_info("%s: firmware unchanged or newer, skipping flash\n",
-			__func__);
-		err = 0;
+	if (TFTF_OFFSET + fw->size > mtd_info->size) {
+		pr_err("%s: firmware too large for %s\n", __func__, partition);
+		err = -EFBIG;
 		goto cleanup;
 	}
 
-	/* Erase the flash */
-	err = apba_mtd_erase(mtd_info, 0, mtd_info->size);
-	if (err < 0) {
-		pr_err("%s: mtd flash failed for %s, err=%d\n",
-			__func__, partition, err);
+	if (apba_flashed_is_newer(ctrl, mtd_info, fw)) {
+		pr_info("%s: firmware newer, skipping flash\n", __func__);
+		err = 0;
 		goto cleanup;
 	}
 
@@ -1226,42 +1516,17 @@ static int apba_flash_partition(struct apba_ctrl *ctrl,
 
 	construct_ffff_header((ffff_header *)buffer, mtd_info, fw);
 
-	/* Write the first copy of the FFFF header to the flash */
-	err = mtd_write(mtd_info, 0, FFFF_HEADER_SIZE,
-			&retlen, (const u_char *)buffer);
+	/* Only the erase blocks which differ from the image are rewritten */
+	err = apba_flash_blocks(ctrl, mtd_info, buffer, fw);
 	if (err < 0) {
-		pr_err("%s: write error %d\n", __func__, err);
-		goto free_mem;
-	}
-
-	/* Write the second copy of the FFFF header to the flash */
-	err = mtd_write(mtd_info, FFFF_HEADER_SIZE, FFFF_HEADER_SIZE,
-			&retlen, (const u_char *)buffer);
-	if (err < 0) {
-		pr_err("%s: write error %d\n", __func__, err);
+		pr_err("%s: mtd flash failed for %s, err=%d\n",
+			__func__, partition, err);
 		goto free_mem;
 	}
 
-	/* Write the TFTF header and firmware from the firmware file
-	   one page at a time to allow DMA to be used. */
-	data = fw->data;
-	offset = TFTF_OFFSET;
-	count = fw->size;
-	while (count) {
-		size_t s = count > PAGE_SIZE ? PAGE_SIZE : count;
-
-		memcpy(buffer, data, s);
-
-		err = mtd_write(mtd_info, offset, s, &retlen, buffer);
-		if (err < 0) {
-			pr_err("%s: write error %d\n", __func__, err);
-			goto free_mem;
-		}
-
-		data += s;
-		offset += s;
-		count -= s;
-	}
+	if (!err)
+		pr_info("%s: firmware unchanged, skipping flash\n", __func__);
+	err = 0;
 
 	pr_debug("%s: %s write complete\n", __func__, partition);
 
@@ -1278,7 +1543,8 @@ cleanup:
 
 no_mtd:
 	apba_flash_on(ctrl, false);
-	if (ctrl->desired_on && !err)
+	/* a cancelled flash left the previous image intact */
+	if (ctrl->desired_on && (!err || err == -ECANCELED))
 		apba_on(ctrl, true);
 
 	return err;
@@ -1323,40 +1589,143 @@ static int request_fw_and_flash(struct apba_ctrl *ctrl,
 	return err;
 }
 
+static void apba_flash_work_func(struct work_struct *work)
+{
+	struct apba_ctrl *ctrl = container_of(work, struct apba_ctrl,
+					      flash_work);
+	enum apba_flash_state state;
+	int err;
+
+	apba_send_kobj_uevent("APBA_EVENT=FLASH_STARTED");
+
+	mutex_lock(&ctrl->mtd_lock);
+	err = request_fw_and_flash(ctrl, ctrl->flash_fw_name,
+				   APBA_FIRMWARE_PARTITION);
+	mutex_unlock(&ctrl->mtd_lock);
+
+	if (err == -ECANCELED)
+		state = APBA_FLASH_CANCELLED;
+	else if (err)
+		state = APBA_FLASH_FAILED;
+	else
+		state = APBA_FLASH_DONE;
+
+	mutex_lock(&ctrl->flash_lock);
+	ctrl->flash_end = ktime_get();
+	ctrl->flash_result = err;
+	ctrl->flash_state = state;
+	mutex_unlock(&ctrl->flash_lock);
+
+	switch (state) {
+	case APBA_FLASH_CANCELLED:
+		apba_send_kobj_uevent("APBA_EVENT=FLASH_CANCELLED");
+		break;
+	case APBA_FLASH_FAILED:
+		apba_send_kobj_uevent("APBA_EVENT=FLASH_FAILED");
+		break;
+	default:
+		apba_send_kobj_uevent("APBA_EVENT=FLASH_DONE");
+		break;
+	}
+}
+
 /*
  * Given a specific firmware file name as input to this sys fs file,
  * attempt to load that firmware file and flash it in the apba
- * flash partition.
+ * flash partition. The flashing runs in the background, its progress
+ * is reported by flash_status and uevents.
  */
 static ssize_t flash_file_store(struct device *dev,
 	struct device_attribute *attr, const char *buf, size_t count)
 {
 	struct platform_device *pdev = to_platform_device(dev);
 	struct apba_ctrl *ctrl = platform_get_drvdata(pdev);
-	/* Null-termination accounted for. */
-	char fw_name[APBA_FIRMWARE_NAME_LEN];
 	size_t fw_name_sz = count;
-	int err;
 
 	if (fw_name_sz && buf[fw_name_sz - 1] == '\n')
 		fw_name_sz--;
 
-	if (!fw_name_sz || (fw_name_sz >= sizeof(fw_name))) {
+	/* Null-termination accounted for. */
+	if (!fw_name_sz || (fw_name_sz >= sizeof(ctrl->flash_fw_name))) {
 		pr_err("%s: firmware name too large %s\n",
 			__func__, buf);
 		return -EINVAL;
 	}
 
-	memcpy(fw_name, buf, fw_name_sz);
-	fw_name[fw_name_sz] = 0;
+	mutex_lock(&ctrl->flash_lock);
+	if (ctrl->flash_state == APBA_FLASH_RUNNING) {
+		mutex_unlock(&ctrl->flash_lock);
+		return -EBUSY;
+	}
 
-	err = request_fw_and_flash(ctrl, fw_name, APBA_FIRMWARE_PARTITION);
+	memcpy(ctrl->flash_fw_name, buf, fw_name_sz);
+	ctrl->flash_fw_name[fw_name_sz] = 0;
 
-	return err ? err : count;
+	ctrl->flash_state = APBA_FLASH_RUNNING;
+	ctrl->flash_result = 0;
+	ctrl->flash_done = 0;
+	ctrl->flash_total = 0;
+	ctrl->flash_written = 0;
+	ctrl->flash_start = ktime_get();
+	atomic_set(&ctrl->flash_cancel, 0);
+	queue_work(system_long_wq, &ctrl->flash_work);
+	mutex_unlock(&ctrl->flash_lock);
+
+	return count;
 }
 
 static DEVICE_ATTR_WO(flash_file);
 
+static ssize_t flash_status_show(struct device *dev,
+	struct device_attribute *attr, char *buf)
+{
+	struct platform_device *pdev = to_platform_device(dev);
+	struct apba_ctrl *ctrl = platform_get_drvdata(pdev);
+	s64 elapsed_ms;
+	ssize_t count;
+
+	mutex_lock(&ctrl->flash_lock);
+
+	if (ctrl->flash_state == APBA_FLASH_RUNNING)
+		elapsed_ms = ktime_to_ms(ktime_sub(ktime_get(),
+						   ctrl->flash_start));
+	else
+		elapsed_ms = ktime_to_ms(ktime_sub(ctrl->flash_end,
+						   ctrl->flash_start));
+
+	count = scnprintf(buf, PAGE_SIZE,
+		"state=%s result=%d done=%llu total=%llu written=%llu "
+		"elapsed_ms=%lld kbps=%llu\n",
+		apba_flash_state_names[ctrl->flash_state],
+		ctrl->flash_result, ctrl->flash_done, ctrl->flash_total,
+		ctrl->flash_written, elapsed_ms,
+		elapsed_ms > 0 ?
+			div64_u64(ctrl->flash_done * 8, elapsed_ms) : 0ULL);
+
+	mutex_unlock(&ctrl->flash_lock);
+
+	return count;
+}
+
+static DEVICE_ATTR_RO(flash_status);
+
+static ssize_t flash_cancel_store(struct device *dev,
+	struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct platform_device *pdev = to_platform_device(dev);
+	struct apba_ctrl *ctrl = platform_get_drvdata(pdev);
+	unsigned long val;
+
+	if (kstrtoul(buf, 10, &val) < 0 || val != 1)
+		return -EINVAL;
+
+	atomic_set(&ctrl->flash_cancel, 1);
+
+	return count;
+}
+
+static DEVICE_ATTR_WO(flash_cancel);
+
 static ssize_t apba_enable_show(struct device *dev,
 	struct device_attribute *attr, char *buf)
 {
@@ -1544,9 +1913,9 @@ static ssize_t apba_log_show(struct device *dev,
 		}
 	}
 
-	mutex_lock(&g_ctrl->log_mutex);
+	mutex_lock(&apba_log_stream.lock);
 	count = kfifo_out(&apba_log_fifo, buf, PAGE_SIZE - 1);
-	mutex_unlock(&g_ctrl->log_mutex);
+	mutex_unlock(&apba_log_stream.lock);
 
 	return count;
 }
@@ -1570,15 +1939,38 @@ static ssize_t apbe_log_show(struct device *dev,
 		}
 	}
 
-	mutex_lock(&g_ctrl->log_mutex);
+	mutex_lock(&apbe_log_stream.lock);
 	count = kfifo_out(&apbe_log_fifo, buf, PAGE_SIZE - 1);
-	mutex_unlock(&g_ctrl->log_mutex);
+	mutex_unlock(&apbe_log_stream.lock);
 
 	return count;
 }
 
 static DEVICE_ATTR_RO(apbe_log);
 
+static ssize_t log_dropped_show(struct device *dev,
+	struct device_attribute *attr, char *buf)
+{
+	unsigned long apba_dropped;
+	unsigned long apbe_dropped;
+
+	if (!g_ctrl)
+		return -ENODEV;
+
+	mutex_lock(&apba_log_stream.lock);
+	apba_dropped = apba_log_stream.dropped;
+	mutex_unlock(&apba_log_stream.lock);
+
+	mutex_lock(&apbe_log_stream.lock);
+	apbe_dropped = apbe_log_stream.dropped;
+	mutex_unlock(&apbe_log_stream.lock);
+
+	return scnprintf(buf, PAGE_SIZE, "apba=%lu apbe=%lu\n",
+			 apba_dropped, apbe_dropped);
+}
+
+static DEVICE_ATTR_RO(log_dropped);
+
 static ssize_t apbe_power_store(struct device *dev,
 	struct device_attribute *attr, const char *buf, size_t count)
 {
@@ -1883,10 +2275,45 @@ static ssize_t unipro_stats_show(struct device *dev,
 
 static DEVICE_ATTR_RO(unipro_stats);
 
+static ssize_t unipro_stats_period_show(struct device *dev,
+	struct device_attribute *attr, char *buf)
+{
+	if (!g_ctrl)
+		return -ENODEV;
+
+	return scnprintf(buf, PAGE_SIZE, "%u\n", g_ctrl->stats_period_ms);
+}
+
+static ssize_t unipro_stats_period_store(struct device *dev,
+	struct device_attribute *attr, const char *buf, size_t count)
+{
+	unsigned long val;
+
+	if (!g_ctrl)
+		return -ENODEV;
+
+	if (kstrtoul(buf, 10, &val) < 0)
+		return -EINVAL;
+
+	/* 0 disables polling, only unsolicited notifications are recorded */
+	if (val && val < APBA_STATS_PERIOD_MIN)
+		return -EINVAL;
+
+	g_ctrl->stats_period_ms = val;
+	if (val && atomic_read(&apba_stats_stream.open))
+		mod_delayed_work(system_wq, &g_ctrl->stats_work, 0);
+
+	return count;
+}
+
+static DEVICE_ATTR_RW(unipro_stats_period);
+
 static struct attribute *apba_attrs[] = {
 	&dev_attr_erase_partition.attr,
 	&dev_attr_flash_enable.attr,
 	&dev_attr_flash_file.attr,
+	&dev_attr_flash_status.attr,
+	&dev_attr_flash_cancel.attr,
 	&dev_attr_apba_enable.attr,
 	&dev_attr_apba_baud.attr,
 	&dev_attr_apba_ids.attr,
@@ -1894,6 +2321,7 @@ static struct attribute *apba_attrs[] = {
 	&dev_attr_apba_mode.attr,
 	&dev_attr_apbe_ids.attr,
 	&dev_attr_apbe_log.attr,
+	&dev_attr_log_dropped.attr,
 	&dev_attr_apbe_power.attr,
 	&dev_attr_apbe_status.attr,
 	&dev_attr_apba_read.attr,
@@ -1908,11 +2336,256 @@ static struct attribute *apba_attrs[] = {
 	&dev_attr_fw_version.attr,
 	&dev_attr_fw_version_str.attr,
 	&dev_attr_unipro_stats.attr,
+	&dev_attr_unipro_stats_period.attr,
 	NULL,
 };
 
 ATTRIBUTE_GROUPS(apba);
 
+/* UniPro stats stream */
+static void apba_stats_work_func(struct work_struct *work)
+{
+	struct apba_ctrl *ctrl = container_of(to_delayed_work(work),
+					      struct apba_ctrl, stats_work);
+	unsigned int period = ctrl->stats_period_ms;
+
+	if (!period || !atomic_read(&apba_stats_stream.open))
+		return;
+
+	if (ctrl->on && ctrl->mods_uart)
+		apba_send_unipro_stats_req();
+
+	schedule_delayed_work(&ctrl->stats_work, msecs_to_jiffies(period));
+}
+
+static int apba_stats_open(struct inode *inode, struct file *file)
+{
+	struct apba_stats_stream *stream = &apba_stats_stream;
+	unsigned long flags;
+	int ret = 0;
+
+	mutex_lock(&stream->lock);
+	if (!stream->ctrl) {
+		ret = -ENODEV;
+		goto out;
+	}
+
+	if (atomic_cmpxchg(&stream->open, 0, 1)) {
+		ret = -EBUSY;
+		goto out;
+	}
+
+	spin_lock_irqsave(&stream->ring_lock, flags);
+	stream->head = 0;
+	stream->tail = 0;
+	stream->seq = 0;
+	stream->dropped = 0;
+	spin_unlock_irqrestore(&stream->ring_lock, flags);
+
+	file->private_data = stream;
+	schedule_delayed_work(&stream->ctrl->stats_work, 0);
+out:
+	mutex_unlock(&stream->lock);
+
+	return ret ? ret : nonseekable_open(inode, file);
+}
+
+static int apba_stats_release(struct inode *inode, struct file *file)
+{
+	struct apba_stats_stream *stream = file->private_data;
+
+	mutex_lock(&stream->lock);
+	atomic_set(&stream->open, 0);
+	if (stream->ctrl)
+		cancel_delayed_work_sync(&stream->ctrl->stats_work);
+	mutex_unlock(&stream->lock);
+
+	return 0;
+}
+
+static bool apba_stats_pending(struct apba_stats_stream *stream)
+{
+	unsigned long flags;
+	bool pending;
+
+	spin_lock_irqsave(&stream->ring_lock, flags);
+	pending = stream->head != stream->tail;
+	spin_unlock_irqrestore(&stream->ring_lock, flags);
+
+	return pending;
+}
+
+static ssize_t apba_stats_read(struct file *file, char __user *buf,
+	size_t count, loff_t *ppos)
+{
+	struct apba_stats_stream *stream = file->private_data;
+	struct apba_unipro_stats_rec rec;
+	unsigned long flags;
+	ssize_t copied = 0;
+	int ret;
+
+	if (count < sizeof(rec))
+		return -EINVAL;
+
+	if (!apba_stats_pending(stream)) {
+		if (file->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+
+		ret = wait_event_interruptible(stream->wq,
+					       apba_stats_pending(stream));
+		if (ret)
+			return ret;
+	}
+
+	/* Only whole records are returned */
+	while (count - copied >= sizeof(rec)) {
+		spin_lock_irqsave(&stream->ring_lock, flags);
+		if (stream->head == stream->tail) {
+			spin_unlock_irqrestore(&stream->ring_lock, flags);
+			break;
+		}
+		rec = stream->ring[stream->tail & (APBA_STATS_RING_SIZE - 1)];
+		stream->tail++;
+		spin_unlock_irqrestore(&stream->ring_lock, flags);
+
+		if (copy_to_user(buf + copied, &rec, sizeof(rec)))
+			return copied ? copied : -EFAULT;
+
+		copied += sizeof(rec);
+	}
+
+	return copied;
+}
+
+static unsigned int apba_stats_poll(struct file *file,
+	struct poll_table_struct *pll_table)
+{
+	struct apba_stats_stream *stream = file->private_data;
+
+	poll_wait(file, &stream->wq, pll_table);
+
+	return apba_stats_pending(stream) ? POLLIN | POLLRDNORM : 0;
+}
+
+static const struct file_operations apba_stats_fops = {
+	.owner		= THIS_MODULE,
+	.open		= apba_stats_open,
+	.release	= apba_stats_release,
+	.read		= apba_stats_read,
+	.poll		= apba_stats_poll,
+	.llseek		= no_llseek,
+};
+
+static struct miscdevice apba_stats_misc = {
+	.minor		= MISC_DYNAMIC_MINOR,
+	.name		= "apba_unipro_stats",
+	.fops		= &apba_stats_fops,
+};
+
+/* Log streams */
+static void apba_log_stream_set_live(struct apba_log_stream *stream, bool live)
+{
+	mutex_lock(&stream->lock);
+	stream->live = live;
+	mutex_unlock(&stream->lock);
+
+	/* readers sleeping on a stream that went away must see it */
+	if (!live)
+		wake_up_interruptible(&stream->wq);
+}
+
+static int apba_log_open(struct inode *inode, struct file *file)
+{
+	struct apba_log_stream *stream;
+	bool live;
+
+	if (iminor(inode) == apba_log_stream.misc.minor)
+		stream = &apba_log_stream;
+	else if (iminor(inode) == apbe_log_stream.misc.minor)
+		stream = &apbe_log_stream;
+	else
+		return -ENODEV;
+
+	mutex_lock(&stream->lock);
+	live = stream->live;
+	mutex_unlock(&stream->lock);
+
+	if (!live)
+		return -ENODEV;
+
+	if (atomic_cmpxchg(&stream->open, 0, 1))
+		return -EBUSY;
+
+	file->private_data = stream;
+
+	return nonseekable_open(inode, file);
+}
+
+static int apba_log_release(struct inode *inode, struct file *file)
+{
+	struct apba_log_stream *stream = file->private_data;
+
+	atomic_set(&stream->open, 0);
+
+	return 0;
+}
+
+static ssize_t apba_log_read(struct file *file, char __user *buf,
+	size_t count, loff_t *ppos)
+{
+	struct apba_log_stream *stream = file->private_data;
+	unsigned int copied;
+	int ret;
+
+	if (!count)
+		return 0;
+
+	/* the sysfs attributes drain the same FIFO, so retry if beaten */
+	do {
+		if (kfifo_is_empty(stream->fifo) && READ_ONCE(stream->live)) {
+			if (file->f_flags & O_NONBLOCK)
+				return -EAGAIN;
+
+			ret = wait_event_interruptible(stream->wq,
+					!kfifo_is_empty(stream->fifo) ||
+					!READ_ONCE(stream->live));
+			if (ret)
+				return ret;
+		}
+
+		mutex_lock(&stream->lock);
+		if (stream->live)
+			ret = kfifo_to_user(stream->fifo, buf, count, &copied);
+		else
+			ret = -ENODEV;
+		mutex_unlock(&stream->lock);
+	} while (!ret && !copied);
+
+	return ret ? ret : copied;
+}
+
+static unsigned int apba_log_poll(struct file *file,
+	struct poll_table_struct *pll_table)
+{
+	struct apba_log_stream *stream = file->private_data;
+
+	poll_wait(file, &stream->wq, pll_table);
+
+	if (!READ_ONCE(stream->live))
+		return POLLERR | POLLHUP;
+
+	return kfifo_is_empty(stream->fifo) ? 0 : POLLIN | POLLRDNORM;
+}
+
+static const struct file_operations apba_log_fops = {
+	.owner		= THIS_MODULE,
+	.open		= apba_log_open,
+	.release	= apba_log_release,
+	.read		= apba_log_read,
+	.poll		= apba_log_poll,
+	.llseek		= no_llseek,
+};
+
 static void apba_firmware_callback(const struct firmware *fw,
 					 void *context)
 {
@@ -1936,7 +2609,9 @@ static void apba_firmware_callback(const struct firmware *fw,
 		pr_debug("%s: size=%zu data=%p\n", __func__, fw->size,
 			fw->data);
 
+		mutex_lock(&ctrl->mtd_lock);
 		err = apba_flash_partition(ctrl, APBA_FIRMWARE_PARTITION, fw);
+		mutex_unlock(&ctrl->mtd_lock);
 		if (err < 0)
 			pr_err("%s: flashing failed err=%d\n", __func__, err);
 
@@ -2303,7 +2978,6 @@ static int apba_ctrl_probe(struct platform_device *pdev)
 		dev_warn(&pdev->dev, "Pinctrl lookup failed for spi_active\n");
 	}
 
-	mutex_init(&ctrl->log_mutex);
 	init_completion(&ctrl->comp);
 	init_completion(&ctrl->apbe_log_comp);
 	init_completion(&ctrl->baud_comp);
@@ -2311,6 +2985,13 @@ static int apba_ctrl_probe(struct platform_device *pdev)
 	init_completion(&ctrl->unipro_comp);
 	init_completion(&ctrl->unipro_stats_comp);
 
+	mutex_init(&ctrl->mtd_lock);
+	mutex_init(&ctrl->flash_lock);
+	INIT_WORK(&ctrl->flash_work, apba_flash_work_func);
+
+	INIT_DELAYED_WORK(&ctrl->stats_work, apba_stats_work_func);
+	ctrl->stats_period_ms = APBA_STATS_PERIOD_DEF;
+
 	ctrl->unipro_mid = APBA_FIRMWARE_UNIPRO_MID;
 	ctrl->unipro_pid = APBA_FIRMWARE_UNIPRO_PID;
 	ctrl->ara_vid = APBA_FIRMWARE_ARA_VID;
@@ -2359,6 +3040,31 @@ static int apba_ctrl_probe(struct platform_device *pdev)
 		goto remove_wq;
 	}
 
+	mutex_lock(&apba_stats_stream.lock);
+	apba_stats_stream.ctrl = ctrl;
+	mutex_unlock(&apba_stats_stream.lock);
+
+	ret = misc_register(&apba_stats_misc);
+	if (ret) {
+		dev_err(&pdev->dev, "Failed to register stats device\n");
+		goto unregister_slave_ctrl;
+	}
+
+	apba_log_stream_set_live(&apba_log_stream, true);
+	apba_log_stream_set_live(&apbe_log_stream, true);
+
+	ret = misc_register(&apba_log_stream.misc);
+	if (ret) {
+		dev_err(&pdev->dev, "Failed to register apba log device\n");
+		goto deregister_misc;
+	}
+
+	ret = misc_register(&apbe_log_stream.misc);
+	if (ret) {
+		dev_err(&pdev->dev, "Failed to register apbe log device\n");
+		goto deregister_apba_log;
+	}
+
 	snprintf(ctrl->firmware_name, sizeof(ctrl->firmware_name),
 		 "upd-%08x-%08x-%08x-%08x-%02x.tftf",
 		 ctrl->unipro_mid, ctrl->unipro_pid,
@@ -2372,7 +3078,7 @@ static int apba_ctrl_probe(struct platform_device *pdev)
 				      apba_firmware_callback);
 	if (ret) {
 		dev_err(g_ctrl->dev, "failed to request firmware.\n");
-		goto unregister_slave_ctrl;
+		goto deregister_apbe_log;
 	}
 
 	ctrl->attach_nb.notifier_call = apba_attach_notifier;
@@ -2382,7 +3088,19 @@ static int apba_ctrl_probe(struct platform_device *pdev)
 
 	return 0;
 
+deregister_apbe_log:
+	misc_deregister(&apbe_log_stream.misc);
+deregister_apba_log:
+	misc_deregister(&apba_log_stream.misc);
+deregister_misc:
+	apba_log_stream_set_live(&apbe_log_stream, false);
+	apba_log_stream_set_live(&apba_log_stream, false);
+	misc_deregister(&apba_stats_misc);
 unregister_slave_ctrl:
+	mutex_lock(&apba_stats_stream.lock);
+	apba_stats_stream.ctrl = NULL;
+	mutex_unlock(&apba_stats_stream.lock);
+
 	mods_unregister_slave_ctrl_driver(&apbe_ctrl_drv);
 remove_wq:
 	destroy_workqueue(ctrl->wq);
@@ -2414,6 +3132,21 @@ static int apba_ctrl_remove(struct platform_device *pdev)
 
 	sysfs_remove_groups(&pdev->dev.kobj, apba_groups);
 
+	atomic_set(&ctrl->flash_cancel, 1);
+	cancel_work_sync(&ctrl->flash_work);
+
+	misc_deregister(&apbe_log_stream.misc);
+	misc_deregister(&apba_log_stream.misc);
+	apba_log_stream_set_live(&apbe_log_stream, false);
+	apba_log_stream_set_live(&apba_log_stream, false);
+	misc_deregister(&apba_stats_misc);
+
+	/* files may still be open, stop them from reaching ctrl */
+	mutex_lock(&apba_stats_stream.lock);
+	apba_stats_stream.ctrl = NULL;
+	cancel_delayed_work_sync(&ctrl->stats_work);
+	mutex_unlock(&apba_stats_stream.lock);
+
 	mods_unregister_slave_ctrl_driver(&apbe_ctrl_drv);
 
 	cancel_work_sync(&apba_disable_work);
@@ -13,7 +13,15 @@
  *
  */
 
+#include <linux/crc16.h>
+#include <linux/debugfs.h>
 #include <linux/kernel.h>
+#include <linux/ktime.h>
+#include <linux/random.h>
+#include <linux/slab.h>
+
+#include "crc.h"
+#include "muc.h"
 
 /* Polynomial is 0x8005 */
 static const uint16_t crc16_lookup_tbl[256] = {
@@ -51,14 +59,173 @@ static const uint16_t crc16_lookup_tbl[256] = {
 	0x1382, 0x1602, 0x1C02, 0x1982, 0x0802, 0x0D82, 0x0782, 0x0202,
 };
 
-static inline u16 crc16_one(u16 crc, const u8 data)
+/*
+ * Slice-by-8 tables. Slice 0 is the byte-wise table for the variant, and
+ * slice k holds the CRC contribution of a byte followed by k zero bytes.
+ * Both variants are reflected, so the same update loop serves both.
+ */
+#define CRC16_SLICES	8
+
+static u16 crc16_muc_slices[CRC16_SLICES][256] __read_mostly;
+static u16 crc16_mhb_slices[CRC16_SLICES][256] __read_mostly;
+
+static struct dentry *crc16_bench_dentry;
+
+static inline u16 crc16_one(const u16 *tbl, u16 crc, const u8 data)
 {
-	return (crc >> 8) ^ crc16_lookup_tbl[(crc ^ data) & 0xff];
+	return (crc >> 8) ^ tbl[(crc ^ data) & 0xff];
 }
 
-uint16_t crc16_calc(uint16_t crc, uint8_t const *buffer, size_t len)
+static u16 crc16_bytewise(const u16 *tbl, u16 crc, const u8 *buffer,
+			  size_t len)
 {
 	while (len--)
-		crc = crc16_one(crc, *buffer++);
+		crc = crc16_one(tbl, crc, *buffer++);
 	return crc;
 }
+
+static u16 crc16_sliced(u16 (*t)[256], u16 crc, const u8 *p, size_t len)
+{
+	/* Loads are byte-wise so this is independent of CPU endianness */
+	while (len >= CRC16_SLICES) {
+		crc = t[7][(crc ^ p[0]) & 0xff] ^
+		      t[6][((crc >> 8) ^ p[1]) & 0xff] ^
+		      t[5][p[2]] ^ t[4][p[3]] ^
+		      t[3][p[4]] ^ t[2][p[5]] ^
+		      t[1][p[6]] ^ t[0][p[7]];
+		p += CRC16_SLICES;
+		len -= CRC16_SLICES;
+	}
+
+	return crc16_bytewise(t[0], crc, p, len);
+}
+
+static void crc16_build_slices(u16 (*t)[256], const u16 *base)
+{
+	int i;
+	int k;
+
+	for (i = 0; i < 256; i++)
+		t[0][i] = base[i];
+
+	for (k = 1; k < CRC16_SLICES; k++)
+		for (i = 0; i < 256; i++)
+			t[k][i] = crc16_one(base, t[k - 1][i], 0);
+}
+
+/* CRC used on the MuC SPI data link */
+uint16_t crc16_calc(uint16_t crc, uint8_t const *buffer, size_t len)
+{
+	return crc16_sliced(crc16_muc_slices, crc, buffer, len);
+}
+
+/* CRC-16 (poly 0x8005, reflected) used by MHB, same result as crc16() */
+uint16_t crc16_mhb(uint16_t crc, uint8_t const *buffer, size_t len)
+{
+	return crc16_sliced(crc16_mhb_slices, crc, buffer, len);
+}
+
+/* Block size used to fold the CRC into a copy while the data is hot */
+#define CRC16_COPY_BLOCK	64
+
+/* Copy len bytes from src to dst and return the MHB CRC of the data */
+uint16_t crc16_mhb_copy(uint16_t crc, uint8_t *dst, uint8_t const *src,
+			size_t len)
+{
+	size_t n;
+
+	while (len) {
+		n = min_t(size_t, len, CRC16_COPY_BLOCK);
+		memcpy(dst, src, n);
+		crc = crc16_sliced(crc16_mhb_slices, crc, dst, n);
+		dst += n;
+		src += n;
+		len -= n;
+	}
+
+	return crc;
+}
+
+#define CRC16_BENCH_SZ		(64 * 1024)
+#define CRC16_BENCH_LOOPS	16
+#define CRC16_BENCH_BUF_SZ	256
+
+static u64 crc16_bench_one(bool sliced, const u8 *data, u16 *result)
+{
+	ktime_t start;
+	u16 crc = 0;
+	int i;
+
+	start = ktime_get();
+	for (i = 0; i < CRC16_BENCH_LOOPS; i++) {
+		if (sliced)
+			crc = crc16_calc(crc, data, CRC16_BENCH_SZ);
+		else
+			crc = crc16_bytewise(crc16_lookup_tbl, crc, data,
+					     CRC16_BENCH_SZ);
+	}
+	*result = crc;
+
+	return ktime_to_ns(ktime_sub(ktime_get(), start)) ? : 1;
+}
+
+/* Compare throughput of the byte-wise and sliced engines */
+static ssize_t crc16_bench_read(struct file *f, char __user *buf,
+				size_t count, loff_t *ppos)
+{
+	char tmp[CRC16_BENCH_BUF_SZ];
+	u64 bytes = (u64)CRC16_BENCH_SZ * CRC16_BENCH_LOOPS;
+	u64 byte_ns;
+	u64 slice_ns;
+	u16 byte_crc;
+	u16 slice_crc;
+	u8 *data;
+	int size;
+
+	/* Only run the benchmark once per open */
+	if (*ppos)
+		return 0;
+
+	data = kmalloc(CRC16_BENCH_SZ, GFP_KERNEL);
+	if (!data)
+		return -ENOMEM;
+
+	get_random_bytes(data, CRC16_BENCH_SZ);
+
+	byte_ns = crc16_bench_one(false, data, &byte_crc);
+	slice_ns = crc16_bench_one(true, data, &slice_crc);
+	kfree(data);
+
+	size = scnprintf(tmp, sizeof(tmp),
+		"bytes:     %llu\n"
+		"bytewise:  %llu ns (%llu MB/s)\n"
+		"slice-by-%d: %llu ns (%llu MB/s)\n"
+		"match:     %s\n",
+		bytes,
+		byte_ns, div64_u64(bytes * 1000, byte_ns),
+		CRC16_SLICES, slice_ns, div64_u64(bytes * 1000, slice_ns),
+		(byte_crc == slice_crc) ? "yes" : "NO");
+
+	return simple_read_from_buffer(buf, count, ppos, tmp, size);
+}
+
+static const struct file_operations crc16_bench_fops = {
+	.read	= crc16_bench_read,
+};
+
+int __init crc16_init(void)
+{
+	crc16_build_slices(crc16_muc_slices, crc16_lookup_tbl);
+	crc16_build_slices(crc16_mhb_slices, crc16_table);
+
+	crc16_bench_dentry = debugfs_create_file("crc16_bench", S_IRUSR,
+				mods_debugfs_get(), NULL, &crc16_bench_fops);
+
+	return 0;
+}
+
+void crc16_exit(void)
+{
+	debugfs_remove(crc16_bench_dentry);
+	crc16_bench_dentry = NULL;
+}
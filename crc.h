@@ -15,5 +15,11 @@
 #define __CRC_H__
 
 extern uint16_t crc16_calc(uint16_t crc, uint8_t const *buffer, size_t len);
+extern uint16_t crc16_mhb(uint16_t crc, uint8_t const *buffer, size_t len);
+extern uint16_t crc16_mhb_copy(uint16_t crc, uint8_t *dst, uint8_t const *src,
+			       size_t len);
+
+int crc16_init(void);
+void crc16_exit(void);
 
 #endif
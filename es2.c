@@ -6,7 +6,11 @@
  *
  * Released under the GPLv2 only.
  */
+#include <linux/bitops.h>
+#include <linux/hrtimer.h>
 #include <linux/kthread.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
 #include <linux/sizes.h>
 #include <linux/usb.h>
 #include <linux/kfifo.h>
@@ -33,11 +37,31 @@ MODULE_DEVICE_TABLE(usb, id_table);
 #define NUM_BULKS		7
 
 /*
- * Number of CPort IN urbs in flight at any point in time.
- * Adjust if we are having stalls in the USB buffer due to not enough urbs in
- * flight.
+ * Number of CPort IN urbs in flight on an endpoint. It starts at
+ * NUM_CPORT_IN_URB and is adjusted between the MIN and MAX bounds every
+ * ES2_IN_WINDOW completions: an endpoint that keeps running out of posted
+ * urbs while busy gets one more, one that always had spares gives one back.
  */
 #define NUM_CPORT_IN_URB	4
+#define NUM_CPORT_IN_URB_MIN	2
+#define NUM_CPORT_IN_URB_MAX	8
+#define ES2_IN_WINDOW		64
+
+/*
+ * Busy cports get a dedicated endpoint pair instead of the shared pair 0.
+ * A cport carrying traffic is never remapped, as messages on its old pair
+ * could be overtaken by messages on the new one. The traffic of each cport
+ * is sampled every ES2_BALANCE_PERIOD_MS instead, and a cport that reached
+ * ES2_BALANCE_MIN_MSGS in a period gets a free pair when it is next enabled.
+ * The pair is given back when the cport is disabled.
+ */
+#define ES2_BALANCE_PERIOD_MS	1000
+#define ES2_BALANCE_MIN_MSGS	64
+
+static bool balance_eps;
+module_param(balance_eps, bool, 0444);
+MODULE_PARM_DESC(balance_eps,
+		 "Give busy cports their own endpoint pair (bridge must support REQUEST_EP_MAPPING)");
 
 /* Number of CPort OUT urbs in flight at any point in time.
  * Adjust if we get messages saying we are out of urbs in the system log.
@@ -60,22 +84,110 @@ MODULE_DEVICE_TABLE(usb, id_table);
 #define REQUEST_LATENCY_TAG_EN	0x06
 #define REQUEST_LATENCY_TAG_DIS	0x07
 
+/*
+ * vendor request to negotiate bulk out aggregation: IN returns the largest
+ * aggregated transfer the bridge accepts, OUT enables it with that size in
+ * wValue (0 disables).
+ */
+#define REQUEST_AGGREGATION	0x08
+
+/*
+ * Small CPort OUT messages may be packed back to back into one bulk
+ * transfer. Each keeps its operation header, whose size field delimits it
+ * and whose pad byte carries its cport id, so the bridge can split them.
+ * A transfer is sent right away on an idle endpoint, otherwise when full,
+ * when the previous transfer completes, or after ES2_AGGR_FLUSH_US.
+ */
+#define ES2_AGGR_BUF_SIZE	ES2_GBUF_MSG_SIZE_MAX
+#define ES2_AGGR_MSG_SIZE_MAX	256
+#define ES2_AGGR_MSGS		32
+#define ES2_AGGR_XFERS		2
+#define ES2_AGGR_FLUSH_US	200
+
+static bool aggregate = true;
+module_param(aggregate, bool, 0444);
+MODULE_PARM_DESC(aggregate, "Aggregate small CPort OUT messages if supported");
+
 /*
  * @endpoint: bulk in endpoint for CPort data
+ * @es2: the bridge the endpoint belongs to
  * @urb: array of urbs for the CPort in messages
  * @buffer: array of buffers for the @cport_in_urb urbs
+ * @lock: protects the depth accounting below
+ * @depth: number of urbs to keep posted
+ * @posted: number of urbs currently posted
+ * @idle: urbs parked while @depth is lowered
+ * @completions, @starved, @min_spare, @window_start: current window
+ * @rate: completions per second over the last window
+ * @grown, @shrunk: number of depth changes
+ * @msgs, @bytes: received traffic
  */
 struct es2_cport_in {
 	__u8 endpoint;
-	struct urb *urb[NUM_CPORT_IN_URB];
-	u8 *buffer[NUM_CPORT_IN_URB];
+	struct es2_ap_dev *es2;
+	struct urb *urb[NUM_CPORT_IN_URB_MAX];
+	u8 *buffer[NUM_CPORT_IN_URB_MAX];
+
+	spinlock_t lock;
+	unsigned int depth;
+	unsigned int posted;
+	struct urb *idle[NUM_CPORT_IN_URB_MAX];
+	unsigned int num_idle;
+
+	unsigned int completions;
+	unsigned int starved;
+	unsigned int min_spare;
+	ktime_t window_start;
+
+	unsigned long rate;
+	unsigned long grown;
+	unsigned long shrunk;
+	u64 msgs;
+	u64 bytes;
+};
+
+struct es2_cport_out;
+
+/*
+ * @cport_out: endpoint the transfer belongs to
+ * @urb: urb for the aggregated transfer
+ * @buffer: packed messages
+ * @len: bytes used in @buffer
+ * @count: number of slots used in @msgs, a slot is cleared when its message
+ *	   is cancelled while the transfer is in flight
+ * @busy: filling or in flight
+ */
+struct es2_aggr_xfer {
+	struct es2_cport_out *cport_out;
+	struct urb *urb;
+	u8 *buffer;
+	size_t len;
+	unsigned int count;
+	bool busy;
+	struct gb_message *msgs[ES2_AGGR_MSGS];
 };
 
 /*
  * @endpoint: bulk out endpoint for CPort data
+ * @es2: the bridge the endpoint belongs to
+ * @aggr_lock: protects the aggregation state below
+ * @aggr_xfer: transfers used to aggregate messages
+ * @aggr_filling: transfer currently collecting messages, if any
+ * @aggr_in_flight: number of submitted aggregated transfers
+ * @aggr_timer: flushes @aggr_filling if nothing else does
+ * @msgs: number of messages sent on the endpoint
  */
 struct es2_cport_out {
 	__u8 endpoint;
+	struct es2_ap_dev *es2;
+
+	spinlock_t aggr_lock;
+	struct es2_aggr_xfer aggr_xfer[ES2_AGGR_XFERS];
+	struct es2_aggr_xfer *aggr_filling;
+	unsigned int aggr_in_flight;
+	struct hrtimer aggr_timer;
+
+	atomic_t msgs;
 };
 
 /**
@@ -87,15 +199,29 @@ struct es2_cport_out {
  * @cport_in: endpoint, urbs and buffer for cport in messages
  * @cport_out: endpoint for for cport out messages
  * @cport_out_urb: array of urbs for the CPort out messages
- * @cport_out_urb_busy: array of flags to see if the @cport_out_urb is busy or
- *			not.
- * @cport_out_urb_cancelled: array of flags indicating whether the
- *			corresponding @cport_out_urb is being cancelled
- * @cport_out_urb_lock: locks the @cport_out_urb_busy "list"
+ * @cport_out_urb_busy: bitmap of the @cport_out_urb that are in use, claimed
+ *			and released without taking @cport_out_urb_lock
+ * @cport_out_urb_cancelled: bitmap of the @cport_out_urb being cancelled
+ * @cport_out_urb_lock: locks message->hcpriv against cancellation
+ * @cport_out_urb_exhausted: number of sends that found the pool empty
+ * @cport_out_urb_dynamic: number of urbs allocated because of that
+ * @aggr_size: negotiated size of an aggregated transfer, 0 if disabled
+ * @aggr_msgs: number of messages sent aggregated
+ * @aggr_xfers: number of aggregated transfers submitted
+ *
+ * @cport_msgs: per cport message count of the current balancing period
+ * @cport_rate: per cport message count of the last balancing period
+ * @cport_peak: per cport highest message count of a balancing period
+ * @balance_work: periodically samples the traffic of the cports
+ * @balance_lock: serializes the endpoint pair assignments
+ * @balance: balancing enabled, false once the bridge refused a mapping
+ * @remaps: number of mappings changed by the balancer
  *
  * @apb_log_task: task pointer for logging thread
  * @apb_log_dentry: file system entry for the log file interface
  * @apb_log_enable_dentry: file system entry for enabling logging
+ * @urb_stats_dentry: file system entry for the CPort out urb pool counters
+ * @ep_stats_dentry: file system entry for the endpoint utilisation
  * @apb_log_fifo: kernel FIFO to carry logged data
  */
 struct es2_ap_dev {
@@ -105,16 +231,31 @@ struct es2_ap_dev {
 
 	struct es2_cport_in cport_in[NUM_BULKS];
 	struct es2_cport_out cport_out[NUM_BULKS];
-	struct urb *cport_out_urb[NUM_CPORT_OUT_URB];
-	bool cport_out_urb_busy[NUM_CPORT_OUT_URB];
-	bool cport_out_urb_cancelled[NUM_CPORT_OUT_URB];
+	struct urb *cport_out_urb;
+	DECLARE_BITMAP(cport_out_urb_busy, NUM_CPORT_OUT_URB);
+	DECLARE_BITMAP(cport_out_urb_cancelled, NUM_CPORT_OUT_URB);
 	spinlock_t cport_out_urb_lock;
+	atomic_t cport_out_urb_exhausted;
+	atomic_t cport_out_urb_dynamic;
+
+	size_t aggr_size;
+	atomic_t aggr_msgs;
+	atomic_t aggr_xfers;
 
 	int *cport_to_ep;
+	atomic_t *cport_msgs;
+	u32 *cport_rate;
+	u32 *cport_peak;
+	struct delayed_work balance_work;
+	struct mutex balance_lock;
+	bool balance;
+	unsigned long remaps;
 
 	struct task_struct *apb_log_task;
 	struct dentry *apb_log_dentry;
 	struct dentry *apb_log_enable_dentry;
+	struct dentry *urb_stats_dentry;
+	struct dentry *ep_stats_dentry;
 	DECLARE_KFIFO(apb_log_fifo, char, APB1_LOG_SIZE);
 };
 
@@ -136,6 +277,7 @@ static inline struct es2_ap_dev *hd_to_es2(struct gb_host_device *hd)
 }
 
 static void cport_out_callback(struct urb *urb);
+static int check_urb_status(struct urb *urb);
 static void usb_log_enable(struct es2_ap_dev *es2);
 static void usb_log_disable(struct es2_ap_dev *es2);
 
@@ -149,8 +291,6 @@ static int cport_to_ep_pair(struct es2_ap_dev *es2, u16 cport_id)
 
 #define ES2_TIMEOUT	500	/* 500 ms for the SVC to do something */
 
-/* Disable for now until we work all of this out to keep a warning-free build */
-#if 0
 /* Test if the endpoints pair is already mapped to a cport */
 static int ep_pair_in_use(struct es2_ap_dev *es2, int ep_pair)
 {
@@ -181,7 +321,6 @@ static int map_cport_to_ep(struct es2_ap_dev *es2,
 	if (!cport_to_ep)
 		return -ENOMEM;
 
-	es2->cport_to_ep[cport_id] = ep_pair;
 	cport_to_ep->cport_id = cpu_to_le16(cport_id);
 	cport_to_ep->endpoint_in = es2->cport_in[ep_pair].endpoint;
 	cport_to_ep->endpoint_out = es2->cport_out[ep_pair].endpoint;
@@ -194,8 +333,12 @@ static int map_cport_to_ep(struct es2_ap_dev *es2,
 				 (char *)cport_to_ep,
 				 sizeof(*cport_to_ep),
 				 ES2_TIMEOUT);
-	if (retval == sizeof(*cport_to_ep))
+	if (retval == sizeof(*cport_to_ep)) {
+		es2->cport_to_ep[cport_id] = ep_pair;
 		retval = 0;
+	} else if (retval >= 0) {
+		retval = -EIO;
+	}
 	kfree(cport_to_ep);
 
 	return retval;
@@ -206,7 +349,6 @@ static int unmap_cport(struct es2_ap_dev *es2, u16 cport_id)
 {
 	return map_cport_to_ep(es2, cport_id, 0);
 }
-#endif
 
 static int es2_cport_in_enable(struct es2_ap_dev *es2,
 				struct es2_cport_in *cport_in)
@@ -215,9 +357,23 @@ static int es2_cport_in_enable(struct es2_ap_dev *es2,
 	int ret;
 	int i;
 
-	for (i = 0; i < NUM_CPORT_IN_URB; ++i) {
+	cport_in->depth = NUM_CPORT_IN_URB;
+	cport_in->posted = 0;
+	cport_in->num_idle = 0;
+	cport_in->completions = 0;
+	cport_in->starved = 0;
+	cport_in->min_spare = cport_in->depth;
+	cport_in->window_start = ktime_get();
+
+	for (i = 0; i < NUM_CPORT_IN_URB_MAX; ++i) {
 		urb = cport_in->urb[i];
 
+		if (i >= cport_in->depth) {
+			cport_in->idle[cport_in->num_idle++] = urb;
+			continue;
+		}
+
+		cport_in->posted++;
 		ret = usb_submit_urb(urb, GFP_KERNEL);
 		if (ret) {
 			dev_err(&es2->usb_dev->dev,
@@ -243,62 +399,157 @@ static void es2_cport_in_disable(struct es2_ap_dev *es2,
 	struct urb *urb;
 	int i;
 
-	for (i = 0; i < NUM_CPORT_IN_URB; ++i) {
+	for (i = 0; i < NUM_CPORT_IN_URB_MAX; ++i) {
 		urb = cport_in->urb[i];
 		usb_kill_urb(urb);
 	}
 }
 
-static struct urb *next_free_urb(struct es2_ap_dev *es2, gfp_t gfp_mask)
+/*
+ * Account for a completed urb and adjust the depth at the end of a window.
+ * @posted no longer counts the urb, so it is the number of urbs that were
+ * still waiting for data. Called with the cport_in lock held.
+ */
+static void es2_cport_in_account(struct es2_cport_in *cport_in)
+{
+	unsigned int spare = cport_in->posted;
+	ktime_t now;
+	s64 elapsed;
+
+	cport_in->completions++;
+	if (!spare)
+		cport_in->starved++;
+	if (spare < cport_in->min_spare)
+		cport_in->min_spare = spare;
+
+	if (cport_in->completions < ES2_IN_WINDOW)
+		return;
+
+	now = ktime_get();
+	elapsed = ktime_us_delta(now, cport_in->window_start);
+	cport_in->rate = elapsed > 0 ?
+		div64_u64((u64)cport_in->completions * USEC_PER_SEC, elapsed) :
+		0;
+
+	/* Only a busy endpoint is worth more urbs */
+	if (cport_in->starved > ES2_IN_WINDOW / 8 &&
+			elapsed < USEC_PER_SEC &&
+			cport_in->depth < NUM_CPORT_IN_URB_MAX) {
+		cport_in->depth++;
+		cport_in->grown++;
+	} else if (!cport_in->starved && cport_in->min_spare >= 2 &&
+			cport_in->depth > NUM_CPORT_IN_URB_MIN) {
+		cport_in->depth--;
+		cport_in->shrunk++;
+	}
+
+	cport_in->completions = 0;
+	cport_in->starved = 0;
+	cport_in->min_spare = cport_in->depth;
+	cport_in->window_start = now;
+}
+
+/* Put a completed urb back, and post or park urbs to match the depth */
+static void es2_cport_in_resubmit(struct es2_cport_in *cport_in,
+				  struct urb *urb, bool account)
 {
-	struct urb *urb = NULL;
+	struct device *dev = &cport_in->es2->usb_dev->dev;
+	struct urb *submit[NUM_CPORT_IN_URB_MAX];
 	unsigned long flags;
-	int i;
+	unsigned int n = 0;
+	unsigned int i;
+	int retval;
 
-	spin_lock_irqsave(&es2->cport_out_urb_lock, flags);
+	spin_lock_irqsave(&cport_in->lock, flags);
+	cport_in->posted--;
+	if (account)
+		es2_cport_in_account(cport_in);
+
+	if (cport_in->posted >= cport_in->depth) {
+		cport_in->idle[cport_in->num_idle++] = urb;
+	} else {
+		submit[n++] = urb;
+		while (cport_in->posted + n < cport_in->depth &&
+				cport_in->num_idle)
+			submit[n++] = cport_in->idle[--cport_in->num_idle];
+	}
+	cport_in->posted += n;
+	spin_unlock_irqrestore(&cport_in->lock, flags);
+
+	for (i = 0; i < n; i++) {
+		retval = usb_submit_urb(submit[i], GFP_ATOMIC);
+		if (!retval)
+			continue;
+
+		dev_err(dev, "failed to resubmit in-urb: %d\n", retval);
+		spin_lock_irqsave(&cport_in->lock, flags);
+		cport_in->posted--;
+		cport_in->idle[cport_in->num_idle++] = submit[i];
+		spin_unlock_irqrestore(&cport_in->lock, flags);
+	}
+}
+
+/*
+ * The pool urbs live in one array, so the slot of an urb is known from its
+ * address. Returns -1 for a dynamically allocated urb.
+ */
+static int cport_out_urb_slot(struct es2_ap_dev *es2, struct urb *urb)
+{
+	if (urb < es2->cport_out_urb ||
+			urb >= es2->cport_out_urb + NUM_CPORT_OUT_URB)
+		return -1;
+
+	return urb - es2->cport_out_urb;
+}
+
+static struct urb *next_free_urb(struct es2_ap_dev *es2, gfp_t gfp_mask)
+{
+	struct urb *urb;
+	int i = 0;
 
 	/* Look in our pool of allocated urbs first, as that's the "fastest" */
-	for (i = 0; i < NUM_CPORT_OUT_URB; ++i) {
-		if (es2->cport_out_urb_busy[i] == false &&
-				es2->cport_out_urb_cancelled[i] == false) {
-			es2->cport_out_urb_busy[i] = true;
-			urb = es2->cport_out_urb[i];
+	for (;;) {
+		i = find_next_zero_bit(es2->cport_out_urb_busy,
+				       NUM_CPORT_OUT_URB, i);
+		if (i >= NUM_CPORT_OUT_URB)
 			break;
+
+		if (!test_and_set_bit(i, es2->cport_out_urb_busy)) {
+			if (!test_bit(i, es2->cport_out_urb_cancelled))
+				return &es2->cport_out_urb[i];
+
+			/* Still being cancelled, can't be reused yet */
+			clear_bit_unlock(i, es2->cport_out_urb_busy);
 		}
+		i++;
 	}
-	spin_unlock_irqrestore(&es2->cport_out_urb_lock, flags);
-	if (urb)
-		return urb;
 
 	/*
 	 * Crap, pool is empty, complain to the syslog and go allocate one
 	 * dynamically as we have to succeed.
 	 */
+	atomic_inc(&es2->cport_out_urb_exhausted);
 	dev_dbg(&es2->usb_dev->dev,
 		"No free CPort OUT urbs, having to dynamically allocate one!\n");
-	return usb_alloc_urb(0, gfp_mask);
+	urb = usb_alloc_urb(0, gfp_mask);
+	if (urb)
+		atomic_inc(&es2->cport_out_urb_dynamic);
+
+	return urb;
 }
 
 static void free_urb(struct es2_ap_dev *es2, struct urb *urb)
 {
-	unsigned long flags;
-	int i;
+	int i = cport_out_urb_slot(es2, urb);
+
 	/*
-	 * See if this was an urb in our pool, if so mark it "free", otherwise
-	 * we need to free it ourselves.
+	 * If this was an urb in our pool mark it "free", otherwise we need to
+	 * free it ourselves.
 	 */
-	spin_lock_irqsave(&es2->cport_out_urb_lock, flags);
-	for (i = 0; i < NUM_CPORT_OUT_URB; ++i) {
-		if (urb == es2->cport_out_urb[i]) {
-			es2->cport_out_urb_busy[i] = false;
-			urb = NULL;
-			break;
-		}
-	}
-	spin_unlock_irqrestore(&es2->cport_out_urb_lock, flags);
-
-	/* If urb is not NULL, then we need to free this urb */
-	usb_free_urb(urb);
+	if (i >= 0)
+		clear_bit_unlock(i, es2->cport_out_urb_busy);
+	else
+		usb_free_urb(urb);
 }
 
 /*
@@ -327,6 +578,296 @@ static u16 gb_message_cport_unpack(struct gb_operation_msg_hdr *header)
 	return cport_id;
 }
 
+static void es2_aggr_callback(struct urb *urb);
+
+/* Append a message to the transfer being filled */
+static void es2_aggr_add(struct es2_aggr_xfer *xfer,
+			 struct gb_message *message, size_t len)
+{
+	memcpy(xfer->buffer + xfer->len, message->buffer, len);
+	xfer->len += len;
+	xfer->msgs[xfer->count++] = message;
+}
+
+/* Cut message @index out of the transfer being filled */
+static void es2_aggr_remove(struct es2_aggr_xfer *xfer, unsigned int index)
+{
+	struct gb_message *message = xfer->msgs[index];
+	size_t offset = 0;
+	size_t len;
+	unsigned int i;
+
+	for (i = 0; i < index; i++)
+		offset += sizeof(*xfer->msgs[i]->header) +
+			  xfer->msgs[i]->payload_size;
+	len = sizeof(*message->header) + message->payload_size;
+
+	memmove(xfer->buffer + offset, xfer->buffer + offset + len,
+		xfer->len - offset - len);
+	xfer->len -= len;
+	memmove(&xfer->msgs[index], &xfer->msgs[index + 1],
+		(xfer->count - index - 1) * sizeof(xfer->msgs[0]));
+	xfer->count--;
+}
+
+/* Submit the transfer being filled. Called with aggr_lock held. */
+static int es2_aggr_submit_locked(struct es2_cport_out *cport_out,
+				  struct es2_aggr_xfer **failed)
+{
+	struct es2_ap_dev *es2 = cport_out->es2;
+	struct usb_device *udev = es2->usb_dev;
+	struct es2_aggr_xfer *xfer = cport_out->aggr_filling;
+	int retval;
+
+	*failed = NULL;
+	if (!xfer)
+		return 0;
+
+	cport_out->aggr_filling = NULL;
+	hrtimer_try_to_cancel(&cport_out->aggr_timer);
+
+	usb_fill_bulk_urb(xfer->urb, udev,
+			  usb_sndbulkpipe(udev, cport_out->endpoint),
+			  xfer->buffer, xfer->len, es2_aggr_callback, xfer);
+	xfer->urb->transfer_flags |= URB_ZERO_PACKET;
+
+	retval = usb_submit_urb(xfer->urb, GFP_ATOMIC);
+	if (retval) {
+		dev_err(&udev->dev, "failed to submit aggregated out-urb: %d\n",
+			retval);
+		*failed = xfer;
+		return retval;
+	}
+
+	cport_out->aggr_in_flight++;
+	atomic_inc(&es2->aggr_xfers);
+
+	return 0;
+}
+
+/*
+ * Report the messages of a transfer as sent and make it available again.
+ * Messages are reported with aggr_lock held, so message_cancel() either finds
+ * a message still in @msgs or knows it has been reported.
+ */
+static void es2_aggr_complete(struct es2_aggr_xfer *xfer, int status)
+{
+	struct es2_cport_out *cport_out = xfer->cport_out;
+	struct es2_ap_dev *es2 = cport_out->es2;
+	struct es2_aggr_xfer *failed;
+	struct gb_message *message;
+	unsigned long flags;
+	unsigned int i;
+	int retval;
+
+	spin_lock_irqsave(&cport_out->aggr_lock, flags);
+	for (i = 0; i < xfer->count; i++) {
+		message = xfer->msgs[i];
+		if (!message)
+			continue;	/* cancelled while in flight */
+
+		xfer->msgs[i] = NULL;
+		gb_message_cport_clear(message->header);
+
+		spin_lock(&es2->cport_out_urb_lock);
+		message->hcpriv = NULL;
+		spin_unlock(&es2->cport_out_urb_lock);
+
+		greybus_message_sent(es2->hd, message, status);
+	}
+
+	xfer->busy = false;
+	xfer->count = 0;
+	xfer->len = 0;
+
+	/* Send what queued up behind us */
+	retval = 0;
+	failed = NULL;
+	if (!cport_out->aggr_in_flight)
+		retval = es2_aggr_submit_locked(cport_out, &failed);
+	spin_unlock_irqrestore(&cport_out->aggr_lock, flags);
+
+	if (failed)
+		es2_aggr_complete(failed, retval);
+}
+
+static void es2_aggr_callback(struct urb *urb)
+{
+	struct es2_aggr_xfer *xfer = urb->context;
+	struct es2_cport_out *cport_out = xfer->cport_out;
+	int status = check_urb_status(urb);
+	unsigned long flags;
+
+	spin_lock_irqsave(&cport_out->aggr_lock, flags);
+	cport_out->aggr_in_flight--;
+	spin_unlock_irqrestore(&cport_out->aggr_lock, flags);
+
+	es2_aggr_complete(xfer, status);
+}
+
+static enum hrtimer_restart es2_aggr_timer(struct hrtimer *timer)
+{
+	struct es2_cport_out *cport_out = container_of(timer,
+					struct es2_cport_out, aggr_timer);
+	struct es2_aggr_xfer *failed;
+	unsigned long flags;
+	int retval;
+
+	spin_lock_irqsave(&cport_out->aggr_lock, flags);
+	retval = es2_aggr_submit_locked(cport_out, &failed);
+	spin_unlock_irqrestore(&cport_out->aggr_lock, flags);
+
+	if (failed)
+		es2_aggr_complete(failed, retval);
+
+	return HRTIMER_NORESTART;
+}
+
+/* Send whatever is being aggregated, so a following urb can't overtake it */
+static void es2_aggr_flush(struct es2_cport_out *cport_out)
+{
+	struct es2_aggr_xfer *failed;
+	unsigned long flags;
+	int retval;
+
+	spin_lock_irqsave(&cport_out->aggr_lock, flags);
+	retval = es2_aggr_submit_locked(cport_out, &failed);
+	spin_unlock_irqrestore(&cport_out->aggr_lock, flags);
+
+	if (failed)
+		es2_aggr_complete(failed, retval);
+}
+
+/*
+ * Add a message, with its cport id already packed, to the transfer being
+ * filled on the endpoint. Returns -EAGAIN if it has to be sent on its own.
+ */
+static int es2_aggr_queue(struct es2_cport_out *cport_out,
+			  struct gb_message *message, size_t len)
+{
+	struct es2_ap_dev *es2 = cport_out->es2;
+	struct es2_aggr_xfer *xfer;
+	struct es2_aggr_xfer *failed = NULL;
+	unsigned long flags;
+	int retval = 0;
+	int i;
+
+	spin_lock_irqsave(&cport_out->aggr_lock, flags);
+
+	xfer = cport_out->aggr_filling;
+	if (xfer && (xfer->len + len > es2->aggr_size ||
+			xfer->count == ES2_AGGR_MSGS)) {
+		retval = es2_aggr_submit_locked(cport_out, &failed);
+		xfer = NULL;
+	}
+
+	if (!xfer) {
+		for (i = 0; i < ES2_AGGR_XFERS; i++) {
+			if (!cport_out->aggr_xfer[i].busy) {
+				xfer = &cport_out->aggr_xfer[i];
+				break;
+			}
+		}
+		if (!xfer) {
+			spin_unlock_irqrestore(&cport_out->aggr_lock, flags);
+			if (failed)
+				es2_aggr_complete(failed, retval);
+			return -EAGAIN;
+		}
+		xfer->busy = true;
+		cport_out->aggr_filling = xfer;
+	}
+
+	es2_aggr_add(xfer, message, len);
+	atomic_inc(&es2->aggr_msgs);
+
+	spin_lock(&es2->cport_out_urb_lock);
+	message->hcpriv = xfer;
+	spin_unlock(&es2->cport_out_urb_lock);
+
+	/* An idle endpoint sends right away, otherwise wait for more */
+	if (!cport_out->aggr_in_flight && !failed) {
+		retval = es2_aggr_submit_locked(cport_out, &failed);
+	} else if (!hrtimer_active(&cport_out->aggr_timer)) {
+		hrtimer_start(&cport_out->aggr_timer,
+			      ktime_set(0, ES2_AGGR_FLUSH_US * NSEC_PER_USEC),
+			      HRTIMER_MODE_REL);
+	}
+
+	spin_unlock_irqrestore(&cport_out->aggr_lock, flags);
+
+	if (failed)
+		es2_aggr_complete(failed, retval);
+
+	return 0;
+}
+
+/* Return the aggregated transfer @hcpriv points to, if it is one */
+static struct es2_aggr_xfer *es2_aggr_xfer_of(struct es2_ap_dev *es2,
+					      void *hcpriv)
+{
+	int bulk_out;
+	int i;
+
+	for (bulk_out = 0; bulk_out < NUM_BULKS; bulk_out++) {
+		for (i = 0; i < ES2_AGGR_XFERS; i++) {
+			if (hcpriv == &es2->cport_out[bulk_out].aggr_xfer[i])
+				return &es2->cport_out[bulk_out].aggr_xfer[i];
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Take a message back out of an aggregated transfer. The shared urb is never
+ * killed for one message: if the transfer is still being filled the message
+ * is cut out of the buffer, if it is in flight it is only forgotten and its
+ * copy goes out with the others. Nothing is left to do if the transfer has
+ * already reported the message.
+ */
+static void es2_aggr_cancel(struct es2_aggr_xfer *xfer,
+			    struct gb_message *message)
+{
+	struct es2_cport_out *cport_out = xfer->cport_out;
+	struct es2_ap_dev *es2 = cport_out->es2;
+	unsigned long flags;
+	unsigned int i;
+
+	spin_lock_irqsave(&cport_out->aggr_lock, flags);
+	for (i = 0; i < xfer->count; i++) {
+		if (xfer->msgs[i] == message)
+			break;
+	}
+	if (i == xfer->count) {
+		spin_unlock_irqrestore(&cport_out->aggr_lock, flags);
+		return;
+	}
+
+	if (cport_out->aggr_filling == xfer) {
+		es2_aggr_remove(xfer, i);
+		if (!xfer->count) {
+			xfer->busy = false;
+			xfer->len = 0;
+			cport_out->aggr_filling = NULL;
+			hrtimer_try_to_cancel(&cport_out->aggr_timer);
+		}
+	} else {
+		xfer->msgs[i] = NULL;
+	}
+
+	gb_message_cport_clear(message->header);
+
+	spin_lock(&es2->cport_out_urb_lock);
+	message->hcpriv = NULL;
+	spin_unlock(&es2->cport_out_urb_lock);
+
+	spin_unlock_irqrestore(&cport_out->aggr_lock, flags);
+
+	/* As if its urb had been killed */
+	greybus_message_sent(es2->hd, message, -ECANCELED);
+}
+
 /*
  * Returns zero if the message was successfully queued, or a negative errno
  * otherwise.
@@ -340,6 +881,7 @@ static int message_send(struct gb_host_device *hd, u16 cport_id,
 	int retval;
 	struct urb *urb;
 	int ep_pair;
+	struct es2_cport_out *cport_out;
 	unsigned long flags;
 
 	/*
@@ -352,6 +894,27 @@ static int message_send(struct gb_host_device *hd, u16 cport_id,
 		return -EINVAL;
 	}
 
+	buffer_size = sizeof(*message->header) + message->payload_size;
+	ep_pair = cport_to_ep_pair(es2, cport_id);
+	cport_out = &es2->cport_out[ep_pair];
+
+	atomic_inc(&es2->cport_msgs[cport_id]);
+	atomic_inc(&cport_out->msgs);
+
+	if (es2->aggr_size) {
+		if (buffer_size <= ES2_AGGR_MSG_SIZE_MAX &&
+				buffer_size <= es2->aggr_size) {
+			gb_message_cport_pack(message->header, cport_id);
+			if (!es2_aggr_queue(cport_out, message, buffer_size)) {
+				trace_gb_host_device_send(hd, cport_id,
+							  buffer_size);
+				return 0;
+			}
+			gb_message_cport_clear(message->header);
+		}
+		es2_aggr_flush(cport_out);
+	}
+
 	/* Find a free urb */
 	urb = next_free_urb(es2, gfp_mask);
 	if (!urb)
@@ -364,12 +927,8 @@ static int message_send(struct gb_host_device *hd, u16 cport_id,
 	/* Pack the cport id into the message header */
 	gb_message_cport_pack(message->header, cport_id);
 
-	buffer_size = sizeof(*message->header) + message->payload_size;
-
-	ep_pair = cport_to_ep_pair(es2, cport_id);
 	usb_fill_bulk_urb(urb, udev,
-			  usb_sndbulkpipe(udev,
-					  es2->cport_out[ep_pair].endpoint),
+			  usb_sndbulkpipe(udev, cport_out->endpoint),
 			  message->buffer, buffer_size,
 			  cport_out_callback, message);
 	urb->transfer_flags |= URB_ZERO_PACKET;
@@ -398,33 +957,36 @@ static void message_cancel(struct gb_message *message)
 {
 	struct gb_host_device *hd = message->operation->connection->hd;
 	struct es2_ap_dev *es2 = hd_to_es2(hd);
+	struct es2_aggr_xfer *xfer;
 	struct urb *urb;
-	int i;
+	int i = -1;
 
 	might_sleep();
 
 	spin_lock_irq(&es2->cport_out_urb_lock);
+	xfer = es2_aggr_xfer_of(es2, message->hcpriv);
+	if (xfer) {
+		spin_unlock_irq(&es2->cport_out_urb_lock);
+		es2_aggr_cancel(xfer, message);
+		return;
+	}
 	urb = message->hcpriv;
 
 	/* Prevent dynamically allocated urb from being deallocated. */
 	usb_get_urb(urb);
 
 	/* Prevent pre-allocated urb from being reused. */
-	for (i = 0; i < NUM_CPORT_OUT_URB; ++i) {
-		if (urb == es2->cport_out_urb[i]) {
-			es2->cport_out_urb_cancelled[i] = true;
-			break;
-		}
+	if (urb) {
+		i = cport_out_urb_slot(es2, urb);
+		if (i >= 0)
+			set_bit(i, es2->cport_out_urb_cancelled);
 	}
 	spin_unlock_irq(&es2->cport_out_urb_lock);
 
 	usb_kill_urb(urb);
 
-	if (i < NUM_CPORT_OUT_URB) {
-		spin_lock_irq(&es2->cport_out_urb_lock);
-		es2->cport_out_urb_cancelled[i] = false;
-		spin_unlock_irq(&es2->cport_out_urb_lock);
-	}
+	if (i >= 0)
+		clear_bit(i, es2->cport_out_urb_cancelled);
 
 	usb_free_urb(urb);
 }
@@ -449,19 +1011,79 @@ static int cport_reset(struct gb_host_device *hd, u16 cport_id)
 	return 0;
 }
 
+/*
+ * Give a cport that was busy before a free endpoint pair of its own. It is
+ * only done while the cport is being enabled and carries no traffic yet.
+ */
+static void es2_balance_place(struct es2_ap_dev *es2, u16 cport_id)
+{
+	int ep_pair;
+	int retval;
+
+	mutex_lock(&es2->balance_lock);
+	if (!es2->balance || es2->cport_to_ep[cport_id] ||
+	    es2->cport_peak[cport_id] < ES2_BALANCE_MIN_MSGS)
+		goto out;
+
+	for (ep_pair = 1; ep_pair < NUM_BULKS; ep_pair++) {
+		if (!ep_pair_in_use(es2, ep_pair))
+			break;
+	}
+	if (ep_pair == NUM_BULKS)
+		goto out;
+
+	retval = map_cport_to_ep(es2, cport_id, ep_pair);
+	if (retval) {
+		dev_warn(&es2->usb_dev->dev,
+			 "endpoint mapping failed (%d), balancing disabled\n",
+			 retval);
+		es2->balance = false;
+		goto out;
+	}
+	es2->remaps++;
+	dev_dbg(&es2->usb_dev->dev, "cport %u mapped to endpoints %d\n",
+		cport_id, ep_pair);
+out:
+	mutex_unlock(&es2->balance_lock);
+}
+
 static int cport_enable(struct gb_host_device *hd, u16 cport_id)
 {
+	struct es2_ap_dev *es2 = hd_to_es2(hd);
 	int retval;
 
 	if (cport_id != GB_SVC_CPORT_ID) {
 		retval = cport_reset(hd, cport_id);
 		if (retval)
 			return retval;
+
+		es2_balance_place(es2, cport_id);
 	}
 
 	return 0;
 }
 
+/* The connection is gone, give its endpoint pair back */
+static int cport_disable(struct gb_host_device *hd, u16 cport_id)
+{
+	struct es2_ap_dev *es2 = hd_to_es2(hd);
+	int retval = 0;
+
+	mutex_lock(&es2->balance_lock);
+	if (cport_id < hd->num_cports && es2->cport_to_ep[cport_id]) {
+		retval = unmap_cport(es2, cport_id);
+		if (retval)
+			dev_err(&es2->usb_dev->dev,
+				"failed to unmap cport %u: %d\n", cport_id,
+				retval);
+		else
+			es2->remaps++;
+	}
+	mutex_unlock(&es2->balance_lock);
+
+	return retval;
+}
+
 static int latency_tag_enable(struct gb_host_device *hd, u16 cport_id)
 {
 	int retval;
@@ -513,6 +1135,7 @@ static struct gb_hd_driver es2_driver = {
 	.message_send		= message_send,
 	.message_cancel		= message_cancel,
 	.cport_enable		= cport_enable,
+	.cport_disable		= cport_disable,
 	.latency_tag_enable	= latency_tag_enable,
 	.latency_tag_disable	= latency_tag_disable,
 };
@@ -546,28 +1169,47 @@ static int check_urb_status(struct urb *urb)
 static void es2_destroy(struct es2_ap_dev *es2)
 {
 	struct usb_device *udev;
+	int bulk_out;
 	int bulk_in;
 	int i;
 
+	cancel_delayed_work_sync(&es2->balance_work);
+
+	debugfs_remove(es2->ep_stats_dentry);
+	debugfs_remove(es2->urb_stats_dentry);
 	debugfs_remove(es2->apb_log_enable_dentry);
 	usb_log_disable(es2);
 
 	/* Tear down everything! */
-	for (i = 0; i < NUM_CPORT_OUT_URB; ++i) {
-		struct urb *urb = es2->cport_out_urb[i];
+	for (bulk_out = 0; bulk_out < NUM_BULKS; bulk_out++) {
+		struct es2_cport_out *cport_out = &es2->cport_out[bulk_out];
+
+		hrtimer_cancel(&cport_out->aggr_timer);
+		for (i = 0; i < ES2_AGGR_XFERS; i++) {
+			struct es2_aggr_xfer *xfer = &cport_out->aggr_xfer[i];
+
+			if (xfer->urb) {
+				usb_kill_urb(xfer->urb);
+				usb_free_urb(xfer->urb);
+				xfer->urb = NULL;
+			}
+			kfree(xfer->buffer);
+			xfer->buffer = NULL;
+		}
+	}
 
-		if (!urb)
-			break;
-		usb_kill_urb(urb);
-		usb_free_urb(urb);
-		es2->cport_out_urb[i] = NULL;
-		es2->cport_out_urb_busy[i] = false;	/* just to be anal */
+	if (es2->cport_out_urb) {
+		for (i = 0; i < NUM_CPORT_OUT_URB; ++i)
+			usb_kill_urb(&es2->cport_out_urb[i]);
+		kfree(es2->cport_out_urb);
+		es2->cport_out_urb = NULL;
+		bitmap_zero(es2->cport_out_urb_busy, NUM_CPORT_OUT_URB);
 	}
 
 	for (bulk_in = 0; bulk_in < NUM_BULKS; bulk_in++) {
 		struct es2_cport_in *cport_in = &es2->cport_in[bulk_in];
 
-		for (i = 0; i < NUM_CPORT_IN_URB; ++i) {
+		for (i = 0; i < NUM_CPORT_IN_URB_MAX; ++i) {
 			struct urb *urb = cport_in->urb[i];
 
 			if (!urb)
@@ -578,6 +1220,9 @@ static void es2_destroy(struct es2_ap_dev *es2)
 		}
 	}
 
+	kfree(es2->cport_peak);
+	kfree(es2->cport_rate);
+	kfree(es2->cport_msgs);
 	kfree(es2->cport_to_ep);
 
 	udev = es2->usb_dev;
@@ -601,17 +1246,23 @@ static void ap_disconnect(struct usb_interface *interface)
 
 static void cport_in_callback(struct urb *urb)
 {
-	struct gb_host_device *hd = urb->context;
+	struct es2_cport_in *cport_in = urb->context;
+	struct es2_ap_dev *es2 = cport_in->es2;
+	struct gb_host_device *hd = es2->hd;
 	struct device *dev = &urb->dev->dev;
 	struct gb_operation_msg_hdr *header;
 	int status = check_urb_status(urb);
-	int retval;
+	unsigned long flags;
 	u16 cport_id;
 
 	if (status) {
 		if ((status == -EAGAIN) || (status == -EPROTO))
 			goto exit;
 		dev_err(dev, "urb cport in error %d (dropped)\n", status);
+
+		spin_lock_irqsave(&cport_in->lock, flags);
+		cport_in->posted--;
+		spin_unlock_irqrestore(&cport_in->lock, flags);
 		return;
 	}
 
@@ -626,16 +1277,20 @@ static void cport_in_callback(struct urb *urb)
 
 	if (cport_id_valid(hd, cport_id)) {
 		trace_gb_host_device_recv(hd, cport_id, urb->actual_length);
+		atomic_inc(&es2->cport_msgs[cport_id]);
 		greybus_data_rcvd(hd, cport_id, urb->transfer_buffer,
 							urb->actual_length);
 	} else {
 		dev_err(dev, "invalid cport id %u received\n", cport_id);
 	}
+
+	spin_lock_irqsave(&cport_in->lock, flags);
+	cport_in->msgs++;
+	cport_in->bytes += urb->actual_length;
+	spin_unlock_irqrestore(&cport_in->lock, flags);
 exit:
 	/* put our urb back in the request pool */
-	retval = usb_submit_urb(urb, GFP_ATOMIC);
-	if (retval)
-		dev_err(dev, "failed to resubmit in-urb: %d\n", retval);
+	es2_cport_in_resubmit(cport_in, urb, !status);
 }
 
 static void cport_out_callback(struct urb *urb)
@@ -789,6 +1444,331 @@ static const struct file_operations apb_log_enable_fops = {
 	.write	= apb_log_enable_write,
 };
 
+static ssize_t urb_stats_read(struct file *f, char __user *buf,
+				size_t count, loff_t *ppos)
+{
+	struct es2_ap_dev *es2 = f->f_inode->i_private;
+	char tmp_buf[160];
+	int len;
+
+	len = scnprintf(tmp_buf, sizeof(tmp_buf),
+			"busy: %u/%u\nexhausted: %d\ndynamic: %d\n"
+			"aggregation: %zu\naggregated msgs: %d\n"
+			"aggregated xfers: %d\n",
+			bitmap_weight(es2->cport_out_urb_busy,
+				      NUM_CPORT_OUT_URB),
+			NUM_CPORT_OUT_URB,
+			atomic_read(&es2->cport_out_urb_exhausted),
+			atomic_read(&es2->cport_out_urb_dynamic),
+			es2->aggr_size,
+			atomic_read(&es2->aggr_msgs),
+			atomic_read(&es2->aggr_xfers));
+
+	return simple_read_from_buffer(buf, count, ppos, tmp_buf, len);
+}
+
+static const struct file_operations urb_stats_fops = {
+	.read	= urb_stats_read,
+};
+
+#ifdef GB_ES2_AGGR_SELFTEST
+/*
+ * Split an aggregated transfer the way the bridge does, checking it against
+ * the messages it should hold. Returns the number of messages found or a
+ * negative errno.
+ */
+static int es2_aggr_split(const u8 *buffer, size_t len,
+			  struct gb_message **msgs, const u16 *cport_ids,
+			  unsigned int count)
+{
+	struct gb_operation_msg_hdr hdr;
+	struct gb_message *message;
+	size_t offset = 0;
+	size_t size;
+	unsigned int n = 0;
+
+	while (offset < len) {
+		if (len - offset < sizeof(hdr) || n == count)
+			return -EPROTO;
+
+		memcpy(&hdr, buffer + offset, sizeof(hdr));
+		size = le16_to_cpu(hdr.size);
+		if (size < sizeof(hdr) || size > len - offset)
+			return -EPROTO;
+
+		message = msgs[n];
+		if (size != sizeof(hdr) + message->payload_size ||
+		    hdr.operation_id != message->header->operation_id ||
+		    hdr.pad[0] != (u8)cport_ids[n] ||
+		    memcmp(buffer + offset + sizeof(hdr), message->payload,
+			   message->payload_size))
+			return -EBADMSG;
+
+		offset += size;
+		n++;
+	}
+
+	return n;
+}
+
+/*
+ * Pack messages of assorted sizes and cports as message_send() does, cancel
+ * the first, a middle and the last one, then split the transfer again.
+ */
+static int es2_aggr_selftest(void)
+{
+	struct es2_aggr_xfer *xfer;
+	struct gb_message *msgs;
+	struct gb_message *expect[ES2_AGGR_MSGS];
+	u16 cport_ids[ES2_AGGR_MSGS];
+	u16 expect_ids[ES2_AGGR_MSGS];
+	unsigned int count;
+	unsigned int i, j;
+	size_t len;
+	u8 *payload;
+	int retval;
+
+	xfer = kzalloc(sizeof(*xfer), GFP_KERNEL);
+	msgs = kcalloc(ES2_AGGR_MSGS, sizeof(*msgs), GFP_KERNEL);
+	if (!xfer || !msgs) {
+		retval = -ENOMEM;
+		goto out;
+	}
+
+	xfer->buffer = kmalloc(ES2_AGGR_BUF_SIZE, GFP_KERNEL);
+	if (!xfer->buffer) {
+		retval = -ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < ES2_AGGR_MSGS; i++) {
+		len = sizeof(*msgs[i].header) +
+		      (i * 37) % (ES2_AGGR_MSG_SIZE_MAX -
+				  sizeof(*msgs[i].header) + 1);
+		if (xfer->len + len > ES2_AGGR_BUF_SIZE)
+			break;
+
+		msgs[i].buffer = kzalloc(len, GFP_KERNEL);
+		if (!msgs[i].buffer) {
+			retval = -ENOMEM;
+			goto out;
+		}
+		msgs[i].header = msgs[i].buffer;
+		msgs[i].payload = msgs[i].header + 1;
+		msgs[i].payload_size = len - sizeof(*msgs[i].header);
+		msgs[i].header->size = cpu_to_le16(len);
+		msgs[i].header->operation_id = cpu_to_le16(i + 1);
+		payload = msgs[i].payload;
+		for (j = 0; j < msgs[i].payload_size; j++)
+			payload[j] = i + j;
+
+		cport_ids[i] = i % 7;
+		gb_message_cport_pack(msgs[i].header, cport_ids[i]);
+		es2_aggr_add(xfer, &msgs[i], len);
+	}
+	count = xfer->count;
+	if (count < 3) {
+		retval = -EINVAL;
+		goto out;
+	}
+
+	es2_aggr_remove(xfer, count - 1);
+	es2_aggr_remove(xfer, count / 2);
+	es2_aggr_remove(xfer, 0);
+
+	for (i = 0, j = 0; i < count; i++) {
+		if (i == 0 || i == count / 2 || i == count - 1)
+			continue;
+		expect[j] = &msgs[i];
+		expect_ids[j++] = cport_ids[i];
+	}
+
+	retval = es2_aggr_split(xfer->buffer, xfer->len, expect, expect_ids,
+				j);
+	if (retval >= 0)
+		retval = (retval == j && xfer->count == j) ? 0 : -EBADMSG;
+
+out:
+	if (msgs) {
+		for (i = 0; i < ES2_AGGR_MSGS; i++)
+			kfree(msgs[i].buffer);
+	}
+	kfree(msgs);
+	if (xfer)
+		kfree(xfer->buffer);
+	kfree(xfer);
+
+	return retval;
+}
+
+/* Debug builds only: run the self-test once, at the first probe */
+static void es2_aggr_selftest_run(struct es2_ap_dev *es2)
+{
+	static bool done;
+	int retval;
+
+	if (done)
+		return;
+	done = true;
+
+	retval = es2_aggr_selftest();
+	if (retval)
+		dev_err(&es2->usb_dev->dev, "aggregation self-test failed: %d\n",
+			retval);
+	else
+		dev_info(&es2->usb_dev->dev, "aggregation self-test passed\n");
+}
+#else
+static inline void es2_aggr_selftest_run(struct es2_ap_dev *es2)
+{
+}
+#endif /* GB_ES2_AGGR_SELFTEST */
+
+/*
+ * Ask the bridge whether it can split aggregated CPort OUT transfers, and
+ * enable it if so. Bridges that don't know the request stall it.
+ */
+static void es2_aggr_negotiate(struct es2_ap_dev *es2)
+{
+	struct usb_device *udev = es2->usb_dev;
+	__le16 *max_size;
+	size_t size;
+	int retval;
+
+	es2->aggr_size = 0;
+	if (!aggregate)
+		return;
+
+	max_size = kmalloc(sizeof(*max_size), GFP_KERNEL);
+	if (!max_size)
+		return;
+
+	retval = usb_control_msg(udev, usb_rcvctrlpipe(udev, 0),
+				 REQUEST_AGGREGATION,
+				 USB_DIR_IN | USB_TYPE_VENDOR |
+				 USB_RECIP_INTERFACE, 0, 0, max_size,
+				 sizeof(*max_size), ES2_TIMEOUT);
+	if (retval != sizeof(*max_size)) {
+		dev_dbg(&udev->dev, "bulk out aggregation not supported\n");
+		goto out;
+	}
+
+	size = min_t(size_t, le16_to_cpu(*max_size), ES2_AGGR_BUF_SIZE);
+	if (size < sizeof(struct gb_operation_msg_hdr))
+		goto out;
+
+	retval = usb_control_msg(udev, usb_sndctrlpipe(udev, 0),
+				 REQUEST_AGGREGATION,
+				 USB_DIR_OUT | USB_TYPE_VENDOR |
+				 USB_RECIP_INTERFACE, size, 0, NULL, 0,
+				 ES2_TIMEOUT);
+	if (retval < 0) {
+		dev_err(&udev->dev, "Cannot enable aggregation: %d\n", retval);
+		goto out;
+	}
+
+	es2->aggr_size = size;
+	dev_info(&udev->dev, "bulk out aggregation up to %zu bytes\n", size);
+out:
+	kfree(max_size);
+}
+
+static int es2_aggr_alloc(struct es2_ap_dev *es2)
+{
+	struct es2_aggr_xfer *xfer;
+	int bulk_out;
+	int i;
+
+	for (bulk_out = 0; bulk_out < NUM_BULKS; bulk_out++) {
+		for (i = 0; i < ES2_AGGR_XFERS; i++) {
+			xfer = &es2->cport_out[bulk_out].aggr_xfer[i];
+			xfer->cport_out = &es2->cport_out[bulk_out];
+
+			xfer->urb = usb_alloc_urb(0, GFP_KERNEL);
+			if (!xfer->urb)
+				return -ENOMEM;
+			xfer->buffer = kmalloc(ES2_AGGR_BUF_SIZE, GFP_KERNEL);
+			if (!xfer->buffer)
+				return -ENOMEM;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Sample the traffic of every cport. The peak decides whether a cport gets an
+ * endpoint pair of its own the next time it is enabled.
+ */
+static void es2_balance_work(struct work_struct *work)
+{
+	struct es2_ap_dev *es2 = container_of(to_delayed_work(work),
+					struct es2_ap_dev, balance_work);
+	int i;
+
+	for (i = 0; i < es2->hd->num_cports; i++) {
+		es2->cport_rate[i] = atomic_xchg(&es2->cport_msgs[i], 0);
+		if (es2->cport_rate[i] > es2->cport_peak[i])
+			es2->cport_peak[i] = es2->cport_rate[i];
+	}
+
+	schedule_delayed_work(&es2->balance_work,
+			      msecs_to_jiffies(ES2_BALANCE_PERIOD_MS));
+}
+
+static ssize_t ep_stats_read(struct file *f, char __user *buf,
+				size_t count, loff_t *ppos)
+{
+	struct es2_ap_dev *es2 = f->f_inode->i_private;
+	struct es2_cport_in *cport_in;
+	unsigned long flags;
+	ssize_t ret;
+	char *tmp_buf;
+	int len = 0;
+	int ep_pair;
+	int i;
+
+	tmp_buf = kmalloc(PAGE_SIZE, GFP_KERNEL);
+	if (!tmp_buf)
+		return -ENOMEM;
+
+	len += scnprintf(tmp_buf + len, PAGE_SIZE - len,
+			 "balancer: %s remaps: %lu\n",
+			 es2->balance ? "on" : "off", es2->remaps);
+
+	for (ep_pair = 0; ep_pair < NUM_BULKS; ep_pair++) {
+		cport_in = &es2->cport_in[ep_pair];
+
+		spin_lock_irqsave(&cport_in->lock, flags);
+		len += scnprintf(tmp_buf + len, PAGE_SIZE - len,
+				 "ep%d: in depth %u posted %u rate %lu/s grown %lu shrunk %lu msgs %llu bytes %llu out msgs %d cports:",
+				 ep_pair, cport_in->depth, cport_in->posted,
+				 cport_in->rate, cport_in->grown,
+				 cport_in->shrunk, cport_in->msgs,
+				 cport_in->bytes,
+				 atomic_read(&es2->cport_out[ep_pair].msgs));
+		spin_unlock_irqrestore(&cport_in->lock, flags);
+
+		for (i = 0; i < es2->hd->num_cports; i++) {
+			if (es2->cport_to_ep[i] != ep_pair ||
+					(!ep_pair && !es2->cport_rate[i]))
+				continue;
+			len += scnprintf(tmp_buf + len, PAGE_SIZE - len,
+					 " %d(%u)", i, es2->cport_rate[i]);
+		}
+		len += scnprintf(tmp_buf + len, PAGE_SIZE - len, "\n");
+	}
+
+	ret = simple_read_from_buffer(buf, count, ppos, tmp_buf, len);
+	kfree(tmp_buf);
+
+	return ret;
+}
+
+static const struct file_operations ep_stats_fops = {
+	.read	= ep_stats_read,
+};
+
 static int apb_get_cport_count(struct usb_device *udev)
 {
 	int retval;
@@ -873,6 +1853,21 @@ static int ap_probe(struct usb_interface *interface,
 	es2->usb_intf = interface;
 	es2->usb_dev = udev;
 	spin_lock_init(&es2->cport_out_urb_lock);
+	for (i = 0; i < NUM_BULKS; i++) {
+		struct es2_cport_out *cport_out = &es2->cport_out[i];
+
+		cport_out->es2 = es2;
+		spin_lock_init(&cport_out->aggr_lock);
+		hrtimer_init(&cport_out->aggr_timer, CLOCK_MONOTONIC,
+			     HRTIMER_MODE_REL);
+		cport_out->aggr_timer.function = es2_aggr_timer;
+	}
+	for (i = 0; i < NUM_BULKS; i++) {
+		es2->cport_in[i].es2 = es2;
+		spin_lock_init(&es2->cport_in[i].lock);
+	}
+	INIT_DELAYED_WORK(&es2->balance_work, es2_balance_work);
+	mutex_init(&es2->balance_lock);
 	INIT_KFIFO(es2->apb_log_fifo);
 	usb_set_intfdata(interface, es2);
 
@@ -883,6 +1878,17 @@ static int ap_probe(struct usb_interface *interface,
 		goto error;
 	}
 
+	es2->cport_msgs = kcalloc(hd->num_cports, sizeof(*es2->cport_msgs),
+				  GFP_KERNEL);
+	es2->cport_rate = kcalloc(hd->num_cports, sizeof(*es2->cport_rate),
+				  GFP_KERNEL);
+	es2->cport_peak = kcalloc(hd->num_cports, sizeof(*es2->cport_peak),
+				  GFP_KERNEL);
+	if (!es2->cport_msgs || !es2->cport_rate || !es2->cport_peak) {
+		retval = -ENOMEM;
+		goto error;
+	}
+
 	/* find all bulk endpoints */
 	iface_desc = interface->cur_altsetting;
 	for (i = 0; i < iface_desc->desc.bNumEndpoints; ++i) {
@@ -909,7 +1915,7 @@ static int ap_probe(struct usb_interface *interface,
 	for (bulk_in = 0; bulk_in < NUM_BULKS; bulk_in++) {
 		struct es2_cport_in *cport_in = &es2->cport_in[bulk_in];
 
-		for (i = 0; i < NUM_CPORT_IN_URB; ++i) {
+		for (i = 0; i < NUM_CPORT_IN_URB_MAX; ++i) {
 			struct urb *urb;
 			u8 *buffer;
 
@@ -924,22 +1930,33 @@ static int ap_probe(struct usb_interface *interface,
 					  usb_rcvbulkpipe(udev,
 							  cport_in->endpoint),
 					  buffer, ES2_GBUF_MSG_SIZE_MAX,
-					  cport_in_callback, hd);
+					  cport_in_callback, cport_in);
 			cport_in->urb[i] = urb;
 			cport_in->buffer[i] = buffer;
 		}
 	}
 
-	/* Allocate urbs for our CPort OUT messages */
-	for (i = 0; i < NUM_CPORT_OUT_URB; ++i) {
-		struct urb *urb;
+	/*
+	 * Allocate urbs for our CPort OUT messages. They are kept in a single
+	 * array so that an urb's pool slot follows from its address; the pool
+	 * holds the only reference to them and frees the array on teardown.
+	 */
+	es2->cport_out_urb = kcalloc(NUM_CPORT_OUT_URB,
+				     sizeof(*es2->cport_out_urb), GFP_KERNEL);
+	if (!es2->cport_out_urb)
+		goto error;
+
+	for (i = 0; i < NUM_CPORT_OUT_URB; ++i)
+		usb_init_urb(&es2->cport_out_urb[i]);
+	bitmap_zero(es2->cport_out_urb_busy, NUM_CPORT_OUT_URB);
+	bitmap_zero(es2->cport_out_urb_cancelled, NUM_CPORT_OUT_URB);
 
-		urb = usb_alloc_urb(0, GFP_KERNEL);
-		if (!urb)
+	es2_aggr_selftest_run(es2);
+	es2_aggr_negotiate(es2);
+	if (es2->aggr_size) {
+		retval = es2_aggr_alloc(es2);
+		if (retval)
 			goto error;
-
-		es2->cport_out_urb[i] = urb;
-		es2->cport_out_urb_busy[i] = false;	/* just to be anal */
 	}
 
 	/* XXX We will need to rename this per APB */
@@ -947,6 +1964,12 @@ static int ap_probe(struct usb_interface *interface,
 							(S_IWUSR | S_IRUGO),
 							gb_debugfs_get(), es2,
 							&apb_log_enable_fops);
+	es2->urb_stats_dentry = debugfs_create_file("es2_urb_stats", S_IRUGO,
+						gb_debugfs_get(), es2,
+						&urb_stats_fops);
+	es2->ep_stats_dentry = debugfs_create_file("es2_ep_stats", S_IRUGO,
+						gb_debugfs_get(), es2,
+						&ep_stats_fops);
 
 	retval = gb_hd_add(hd);
 	if (retval)
@@ -958,6 +1981,12 @@ static int ap_probe(struct usb_interface *interface,
 			goto err_disable_cport_in;
 	}
 
+	if (balance_eps) {
+		es2->balance = true;
+		schedule_delayed_work(&es2->balance_work,
+				      msecs_to_jiffies(ES2_BALANCE_PERIOD_MS));
+	}
+
 	return 0;
 
 err_disable_cport_in:
@@ -1062,6 +1062,8 @@ struct gb_svc_dme_peer_set_response {
 /* Attributes for peer get/set operations */
 #define DME_ATTR_SELECTOR_INDEX		0
 #define DME_ATTR_T_TST_SRC_INCREMENT	0x4083
+#define DME_ATTR_DDBL1_MANUFACTURERID	0x5003
+#define DME_ATTR_DDBL1_PRODUCTID	0x5004
 
 /* Return value from TST_SRC_INCREMENT */
 #define DME_TSI_SPI_BOOT_STARTED		0x02
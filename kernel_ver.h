@@ -280,6 +280,14 @@ static inline bool led_sysfs_is_disabled(struct led_classdev *led_cdev)
 }
 #endif
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 19, 0)
+/*
+ * File operations can implement read_iter/write_iter and copy with the
+ * copy_to_iter()/copy_from_iter() helpers.
+ */
+#define FILE_OPS_HAVE_ITER
+#endif
+
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 2, 0)
 /*
  * New helper functions for registering/unregistering flash led devices as v4l2
@@ -21,6 +21,7 @@
 #include <linux/module.h>
 
 #include "apba.h"
+#include "crc.h"
 #include "mods_uart.h"
 #include "muc.h"
 
@@ -39,10 +40,16 @@ static int __init mods_init(void)
 	if (!mods_debug_root)
 		pr_warn("failed to create 'mods' debugfs\n");
 
+	err = crc16_init();
+	if (err) {
+		pr_err("crc16_init failed: %d\n", err);
+		goto exit;
+	}
+
 	err = muc_core_init();
 	if (err) {
 		pr_err("muc_core_init failed: %d\n", err);
-		goto exit;
+		goto core_fail;
 	}
 
 	err = muc_svc_init();
@@ -87,6 +94,8 @@ ap_fail:
 	muc_svc_exit();
 svc_fail:
 	muc_core_exit();
+core_fail:
+	crc16_exit();
 exit:
 	debugfs_remove_recursive(mods_debug_root);
 	mods_debug_root = NULL;
@@ -102,6 +111,7 @@ static void __exit mods_exit(void)
 	mods_ap_exit();
 	muc_svc_exit();
 	muc_core_exit();
+	crc16_exit();
 
 	debugfs_remove_recursive(mods_debug_root);
 	mods_debug_root = NULL;
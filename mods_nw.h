@@ -14,6 +14,9 @@
 #ifndef _MODS_NW_H__
 #define _MODS_NW_H__
 
+#include <linux/ktime.h>
+#include <linux/workqueue.h>
+
 #include "operation.h"
 
 struct mods_dl_device;
@@ -36,6 +39,8 @@ struct mods_dl_driver {
 	int (*message_send)(struct mods_dl_device *nd, uint8_t *payload,
 			size_t size);
 	int (*get_protocol)(uint16_t cport_id, uint8_t *protocol);
+	/* Optional, result of an attach mods_dl_dev_attached() queued */
+	void (*attach_done)(struct mods_dl_device *nd, int err);
 };
 
 enum {
@@ -56,6 +61,26 @@ struct capability {
 };
 
 #define FW_VER_STR_SZ           32
+
+/* Milestones of an interface attach, timestamped for latency tracking */
+enum mods_attach_phase {
+	MODS_ATTACH_DETECT,		/* mod attach detected */
+	MODS_ATTACH_DL_READY,		/* data link negotiated */
+	MODS_ATTACH_MB_VERSION,		/* vendor control version */
+	MODS_ATTACH_IDS,		/* ids, versions and manifest size */
+	MODS_ATTACH_MANIFEST,
+	MODS_ATTACH_HOTPLUG,		/* AP acknowledged hotplug */
+	MODS_ATTACH_CONNECTED,		/* first connection from the AP */
+	MODS_ATTACH_PHASES,
+};
+/* DME attributes the SVC answers on behalf of an interface */
+enum mods_dme_attr {
+	MODS_DME_TST_SRC_INCREMENT,
+	MODS_DME_MANUFACTURERID,
+	MODS_DME_PRODUCTID,
+	MODS_DME_ATTRS,
+};
+
 struct mods_dl_device {
 	struct list_head	list;
 	struct device		*dev;
@@ -67,6 +92,7 @@ struct mods_dl_device {
 	struct kobject		intf_kobj;
 	struct bin_attribute	manifest_attr;
 
+	struct work_struct attach_work;
 	struct muc_svc_hotplug_work *hpw;
 	char *manifest;
 	__le16 manifest_size;
@@ -85,6 +111,8 @@ struct mods_dl_device {
 	uint32_t slave_state;
 	bool high_current_reserved;
 	bool fw_vendor_updates;
+	ktime_t attach_trace[MODS_ATTACH_PHASES];
+	u32 dme_values[MODS_DME_ATTRS];
 };
 
 struct mods_nw_msg_filter {
@@ -12,21 +12,28 @@
  * GNU General Public License for more details.
  */
 
-#include <linux/crc16.h>
+#include <linux/completion.h>
 #include <linux/delay.h>
 #include <linux/err.h>
 #include <linux/interrupt.h>
 #include <linux/jiffies.h>
+#include <linux/list.h>
 #include <linux/module.h>
 #include <linux/mutex.h>
 #include <linux/of_gpio.h>
 #include <linux/of_irq.h>
 #include <linux/pinctrl/pinctrl.h>
 #include <linux/platform_device.h>
+#include <linux/spinlock.h>
 #include <linux/tty.h>
 #include <linux/tty_driver.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
+
+#include <asm/unaligned.h>
 
 #include "apba.h"
+#include "crc.h"
 #include "mods_nw.h"
 #include "mods_uart.h"
 #include "mods_uart_pm.h"
@@ -38,23 +45,64 @@
 
 struct mods_uart_err_stats {
 	uint32_t tx_failure;
+	uint32_t tx_partial;
 	uint32_t rx_crc;
 	uint32_t rx_timeout;
 	uint32_t rx_abort;
 	uint32_t rx_len;
 };
 
+/*
+ * Preallocated TX staging slots. A message is assembled with its header and
+ * CRC in a free slot, so it can be sent with a single write and without
+ * touching the allocator. Filled slots wait on the TX queue until the
+ * sender work writes them out.
+ */
+#define MODS_UART_TX_SLOTS	8
+#define MODS_UART_TX_SLOT_SIZE	(MHB_HDR_SIZE + MHB_MAX_MSG_SIZE + MHB_CRC_SIZE)
+
+struct mods_uart_tx_slot {
+	struct list_head node;
+	int flag;
+	mods_uart_tx_complete_t done_cb;
+	void *ctx;
+	size_t len;
+	uint8_t data[MODS_UART_TX_SLOT_SIZE];
+};
+
+struct mods_uart_tx_wait {
+	struct completion done;
+	int result;
+};
+
+/*
+ * RX ring buffer. Must be a power of two and hold at least two maximum
+ * size segments, so a full ring always contains a complete segment.
+ */
+#define MODS_UART_RX_RING_SIZE	(2 * MHB_MAX_MSG_SIZE)
+#define MODS_UART_RX_RING_MASK	(MODS_UART_RX_RING_SIZE - 1)
+
 struct mods_uart_data {
 	struct platform_device *pdev;
 	struct tty_struct *tty;
 	struct pinctrl *pinctrl;
 	struct pinctrl_state *pinctrl_state_default;
 	struct pinctrl_state *pinctrl_state_active;
-	char rx_data[MHB_MAX_MSG_SIZE];
-	size_t rx_len;
+	uint8_t rx_ring[MODS_UART_RX_RING_SIZE];
+	uint8_t rx_bounce[MHB_MAX_MSG_SIZE]; /* segments wrapping the ring */
+	unsigned int rx_head;                /* free running write index */
+	unsigned int rx_tail;                /* free running read index */
+	bool rx_resync;                      /* scanning for a valid header */
 	unsigned long last_rx;
 	struct mods_uart_err_stats stats;
 	struct mutex tx_mutex;
+	struct mods_uart_tx_slot *tx_slots;
+	unsigned long tx_slots_busy;
+	wait_queue_head_t tx_slot_wq;
+	struct list_head tx_queue;
+	spinlock_t tx_queue_lock;
+	struct workqueue_struct *tx_wq;
+	struct work_struct tx_work;
 	void *mods_uart_pm_data;
 	const char *tty_name;
 	uint8_t intf_id;
@@ -68,6 +116,11 @@ enum {
 
 #define MODS_UART_SEGMENT_TIMEOUT 500 /* msec */
 
+/* Limits for resuming a write the tty could only partially accept */
+#define MODS_UART_TX_TIMEOUT      500 /* msec */
+#define MODS_UART_TX_RETRY_MIN_US 500
+#define MODS_UART_TX_RETRY_MAX_US 1000
+
 #define MIN(a, b) (((a) < (b)) ? (a) : (b))
 
 /* Found in tty_io.c */
@@ -80,104 +133,278 @@ static ssize_t uart_stats_show(struct device *dev,
 	struct mods_uart_data *mud = platform_get_drvdata(pdev);
 
 	return scnprintf(buf, PAGE_SIZE,
-			 "tx err:%d, rx crc:%d, rx timeout:%d, rx abort:%d, "
-			 "rx len:%d\n",
-			 mud->stats.tx_failure, mud->stats.rx_crc,
+			 "tx err:%d, tx partial:%d, rx crc:%d, rx timeout:%d, "
+			 "rx abort:%d, rx len:%d\n",
+			 mud->stats.tx_failure, mud->stats.tx_partial,
+			 mud->stats.rx_crc,
 			 mud->stats.rx_timeout, mud->stats.rx_abort,
 			 mud->stats.rx_len);
 }
 
 static DEVICE_ATTR_RO(uart_stats);
 
+static ssize_t uart_pm_stats_show(struct device *dev,
+				  struct device_attribute *attr, char *buf)
+{
+	struct platform_device *pdev = to_platform_device(dev);
+	struct mods_uart_data *mud = platform_get_drvdata(pdev);
+	ssize_t ret = 0;
+
+	/* The PM data only exists while the TTY is open */
+	mutex_lock(&mud->tx_mutex);
+	if (mud->mods_uart_pm_data)
+		ret = mods_uart_pm_stats_show(mud->mods_uart_pm_data, buf);
+	mutex_unlock(&mud->tx_mutex);
+
+	return ret;
+}
+
+static DEVICE_ATTR_RO(uart_pm_stats);
+
 static struct attribute *uart_attrs[] = {
 	&dev_attr_uart_stats.attr,
+	&dev_attr_uart_pm_stats.attr,
 	NULL,
 };
 
 ATTRIBUTE_GROUPS(uart);
 
-static int mods_uart_send_internal(struct mods_uart_data *mud,
+static struct mods_uart_tx_slot *mods_uart_get_tx_slot(
+	struct mods_uart_data *mud)
+{
+	int i;
+
+	for (i = 0; i < MODS_UART_TX_SLOTS; i++)
+		if (!test_and_set_bit(i, &mud->tx_slots_busy))
+			return &mud->tx_slots[i];
+
+	return NULL;
+}
+
+static void mods_uart_put_tx_slot(struct mods_uart_data *mud,
+				  struct mods_uart_tx_slot *slot)
+{
+	clear_bit(slot - mud->tx_slots, &mud->tx_slots_busy);
+	wake_up(&mud->tx_slot_wq);
+}
+
+/* Assemble header, payload and CRC in one pass over the data */
+static void mods_uart_fill_tx_slot(struct mods_uart_tx_slot *slot,
 				   struct mhb_hdr *hdr, uint8_t *buf,
-				   size_t len, int flag)
+				   size_t len)
+{
+	uint16_t calc_crc;
+
+	hdr->length = cpu_to_le16(len + sizeof(*hdr) + MHB_CRC_SIZE);
+	memcpy(slot->data, hdr, sizeof(*hdr));
+
+	calc_crc = crc16_mhb(0, slot->data, sizeof(*hdr));
+	calc_crc = crc16_mhb_copy(calc_crc, slot->data + sizeof(*hdr), buf,
+				  len);
+	put_unaligned_le16(calc_crc, slot->data + sizeof(*hdr) + len);
+
+	slot->len = sizeof(*hdr) + len + MHB_CRC_SIZE;
+}
+
+/*
+ * Write the whole buffer to the tty. If the tty can only take part of it,
+ * give it time to drain and resume with the remainder.
+ */
+static int mods_uart_write_all(struct mods_uart_data *mud,
+			       const uint8_t *buf, size_t len)
+{
+	unsigned long timeout = jiffies +
+				msecs_to_jiffies(MODS_UART_TX_TIMEOUT);
+	int ret;
+
+	while (len) {
+		ret = mud->tty->ops->write(mud->tty, buf, len);
+		if (ret < 0)
+			return ret;
+
+		buf += ret;
+		len -= ret;
+		if (!len)
+			break;
+
+		if (time_after(jiffies, timeout))
+			return -ETIMEDOUT;
+
+		mud->stats.tx_partial++;
+		usleep_range(MODS_UART_TX_RETRY_MIN_US,
+			     MODS_UART_TX_RETRY_MAX_US);
+	}
+
+	return 0;
+}
+
+static void mods_uart_tx_sync_done(void *ctx, int result)
+{
+	struct mods_uart_tx_wait *wait = ctx;
+
+	wait->result = result;
+	complete(&wait->done);
+}
+
+static struct mods_uart_tx_slot *mods_uart_tx_dequeue(
+	struct mods_uart_data *mud)
+{
+	struct mods_uart_tx_slot *slot;
+	unsigned long flags;
+
+	spin_lock_irqsave(&mud->tx_queue_lock, flags);
+	slot = list_first_entry_or_null(&mud->tx_queue,
+					struct mods_uart_tx_slot, node);
+	if (slot)
+		list_del(&slot->node);
+	spin_unlock_irqrestore(&mud->tx_queue_lock, flags);
+
+	return slot;
+}
+
+static int mods_uart_tx_one(struct mods_uart_data *mud,
+			    struct mods_uart_tx_slot *slot)
 {
 	struct device *dev = &mud->pdev->dev;
 	int ret;
-	u8 *pkt;
-	size_t pkt_size;
-	__le16 calc_crc;
 
 	if (!mud->tty) {
 		dev_err(dev, "%s: no tty\n", __func__);
 		return -ENODEV;
 	}
 
-	if (len > MHB_MAX_MSG_SIZE) {
-		mud->stats.tx_failure++;
-		return -E2BIG;
-	}
+	/*
+	 * This call may block if APBA is in sleep, but only the first
+	 * message of a burst pays for the wake handshake.
+	 * Try to fail through even if wake up was unsuccessful.
+	 */
+	mods_uart_pm_pre_tx(mud->mods_uart_pm_data, slot->flag);
 
-	pkt_size = sizeof(struct mhb_hdr) + len;
-	pkt = kmalloc(pkt_size, GFP_KERNEL);
-	if (!pkt) {
+	print_hex_dump_debug("RAW TX: ", DUMP_PREFIX_OFFSET, 16, 1,
+		slot->data, slot->len, true);
+	ret = mods_uart_write_all(mud, slot->data, slot->len);
+	if (ret) {
+		dev_err(dev, "%s: Failed to send message: %d\n", __func__, ret);
 		mud->stats.tx_failure++;
-		return -ENOMEM;
+		return -EIO;
 	}
 
-	/* Populate the packet */
-	hdr->length = cpu_to_le16(len + sizeof(*hdr) + sizeof(calc_crc));
-	memcpy(pkt, hdr, sizeof(*hdr));
-	memcpy(pkt + sizeof(*hdr), buf, len);
+	mods_uart_pm_post_tx(mud->mods_uart_pm_data, slot->flag);
 
-	calc_crc = crc16(0, pkt, pkt_size);
+	return 0;
+}
+
+/*
+ * Drain the TX queue. Everything queued while the remote is awake goes
+ * out back to back, and the idle timer is only armed once the queue is
+ * empty.
+ */
+static void mods_uart_tx_work(struct work_struct *work)
+{
+	struct mods_uart_data *mud = container_of(work, struct mods_uart_data,
+						  tx_work);
+	struct mods_uart_tx_slot *slot;
+	mods_uart_tx_complete_t done_cb;
+	void *ctx;
+	bool sent = false;
+	int ret;
 
 	mutex_lock(&mud->tx_mutex);
 
-	/*
-	 * This call may block if APBA is in sleep.
-	 * Try to fail through even if wake up was unsuccessful.
-	 */
-	mods_uart_pm_pre_tx(mud->mods_uart_pm_data, flag);
+	while ((slot = mods_uart_tx_dequeue(mud))) {
+		ret = mods_uart_tx_one(mud, slot);
+		if (!ret)
+			sent = true;
 
-	/* First send the message */
-	print_hex_dump_debug("RAW TX: ", DUMP_PREFIX_OFFSET, 16, 1,
-		pkt, pkt_size, true);
-	ret = mud->tty->ops->write(mud->tty, pkt, pkt_size);
-	if (ret != pkt_size) {
-		dev_err(dev, "%s: Failed to send message\n", __func__);
-		goto send_err;
-	}
+		done_cb = slot->done_cb;
+		ctx = slot->ctx;
+		mods_uart_put_tx_slot(mud, slot);
 
-	/* Then send the CRC */
-	print_hex_dump_debug("RAW TX (crc): ", DUMP_PREFIX_OFFSET, 16, 1,
-		(uint8_t *)&calc_crc, sizeof(calc_crc), true);
-	ret = mud->tty->ops->write(mud->tty, (uint8_t *)&calc_crc, sizeof(calc_crc));
-	if (ret != sizeof(calc_crc)) {
-		dev_err(dev, "%s: Failed to send CRC\n", __func__);
-		goto send_err;
+		if (done_cb)
+			done_cb(ctx, ret);
 	}
 
-	mods_uart_pm_post_tx(mud->mods_uart_pm_data, flag);
-	mutex_unlock(&mud->tx_mutex);
-	kfree(pkt);
-	return 0;
+	if (sent && mud->mods_uart_pm_data)
+		mods_uart_pm_update_idle_timer(mud->mods_uart_pm_data);
 
-send_err:
-	mud->stats.tx_failure++;
 	mutex_unlock(&mud->tx_mutex);
-	kfree(pkt);
-	return -EIO;
+}
+
+static int mods_uart_queue_tx(struct mods_uart_data *mud,
+			      struct mhb_hdr *hdr, uint8_t *buf, size_t len,
+			      int flag, mods_uart_tx_complete_t done_cb,
+			      void *ctx)
+{
+	struct device *dev = &mud->pdev->dev;
+	struct mods_uart_tx_slot *slot;
+	unsigned long flags;
+
+	if (!mud->tty) {
+		dev_err(dev, "%s: no tty\n", __func__);
+		return -ENODEV;
+	}
+
+	if (len > MHB_MAX_MSG_SIZE) {
+		mud->stats.tx_failure++;
+		return -E2BIG;
+	}
+
+	wait_event(mud->tx_slot_wq, (slot = mods_uart_get_tx_slot(mud)));
+
+	/* Populate the packet */
+	mods_uart_fill_tx_slot(slot, hdr, buf, len);
+	slot->flag = flag;
+	slot->done_cb = done_cb;
+	slot->ctx = ctx;
+
+	spin_lock_irqsave(&mud->tx_queue_lock, flags);
+	list_add_tail(&slot->node, &mud->tx_queue);
+	spin_unlock_irqrestore(&mud->tx_queue_lock, flags);
+
+	queue_work(mud->tx_wq, &mud->tx_work);
+
+	return 0;
 }
 
 int mods_uart_send(void *uart_data, struct mhb_hdr *hdr, uint8_t *buf,
 	size_t len, int flag)
 {
 	struct mods_uart_data *mud = (struct mods_uart_data *)uart_data;
+	struct mods_uart_tx_wait wait;
+	int ret;
 
 	pr_debug("MHB TX: addr=%x, type=%x, result=%x\n",
 	        hdr->addr, hdr->type, hdr->result);
 	print_hex_dump_debug("MHB TX: ", DUMP_PREFIX_OFFSET, 16, 1,
 		buf, len, true);
-	return mods_uart_send_internal(mud, hdr, buf, len, flag);
+
+	init_completion(&wait.done);
+	ret = mods_uart_queue_tx(mud, hdr, buf, len, flag,
+				 mods_uart_tx_sync_done, &wait);
+	if (ret)
+		return ret;
+
+	wait_for_completion(&wait.done);
+
+	return wait.result;
+}
+
+/*
+ * Queue a message without waiting for it to be sent. The data is copied
+ * before returning. If given, done_cb is called from the sender work
+ * with the result.
+ */
+int mods_uart_send_async(void *uart_data, struct mhb_hdr *hdr, uint8_t *buf,
+	size_t len, int flag, mods_uart_tx_complete_t done_cb, void *ctx)
+{
+	struct mods_uart_data *mud = (struct mods_uart_data *)uart_data;
+
+	pr_debug("MHB TX (async): addr=%x, type=%x, result=%x\n",
+	        hdr->addr, hdr->type, hdr->result);
+	print_hex_dump_debug("MHB TX: ", DUMP_PREFIX_OFFSET, 16, 1,
+		buf, len, true);
+
+	return mods_uart_queue_tx(mud, hdr, buf, len, flag, done_cb, ctx);
 }
 
 int mods_uart_get_baud(void *uart_data)
@@ -382,7 +609,9 @@ int mods_uart_open(void *uart_data)
 	}
 	tty_tmp->disc_data = mud;
 
+	mutex_lock(&mud->tx_mutex);
 	mud->mods_uart_pm_data = mods_uart_pm_initialize(mud);
+	mutex_unlock(&mud->tx_mutex);
 	if (!mud->mods_uart_pm_data) {
 		dev_err(&mud->pdev->dev, "Failed to initialize uart pm\n");
 		goto set_ldisc_tty;
@@ -429,6 +658,9 @@ int mods_uart_close(void *uart_data)
 
 	dev_dbg(&mud->pdev->dev, "%s: closing uart\n", __func__);
 
+	/* Let anything already queued go out before the tty goes away */
+	flush_workqueue(mud->tx_wq);
+
 	if (tty_set_ldisc(tty, N_TTY))
 		dev_err(&mud->pdev->dev, "%s: Failed to set ldisc\n", __func__);
 
@@ -441,12 +673,14 @@ int mods_uart_close(void *uart_data)
 	mutex_lock(&tty_mutex);
 	release_tty(tty, tty->index);
 	mutex_unlock(&tty_mutex);
-	mud->tty = NULL;
 
+	mutex_lock(&mud->tx_mutex);
+	mud->tty = NULL;
 	if (mud->mods_uart_pm_data) {
 		mods_uart_pm_uninitialize(mud->mods_uart_pm_data);
 		mud->mods_uart_pm_data = NULL;
 	}
+	mutex_unlock(&mud->tx_mutex);
 
 	ret = pinctrl_select_state(mud->pinctrl, mud->pinctrl_state_default);
 	if (ret)
@@ -511,12 +745,27 @@ static int mods_uart_probe(struct platform_device *pdev)
 		return PTR_ERR(mud->pinctrl_state_active);
 	}
 
+	mud->tx_slots = devm_kzalloc(&pdev->dev, MODS_UART_TX_SLOTS *
+				     sizeof(*mud->tx_slots), GFP_KERNEL);
+	if (!mud->tx_slots)
+		return -ENOMEM;
+
 	mutex_init(&mud->tx_mutex);
+	init_waitqueue_head(&mud->tx_slot_wq);
+	INIT_LIST_HEAD(&mud->tx_queue);
+	spin_lock_init(&mud->tx_queue_lock);
+	INIT_WORK(&mud->tx_work, mods_uart_tx_work);
+
+	mud->tx_wq = alloc_ordered_workqueue("mods_uart_tx", WQ_HIGHPRI);
+	if (!mud->tx_wq) {
+		dev_err(&pdev->dev, "Failed to create TX workqueue\n");
+		return -ENOMEM;
+	}
 
 	ret = sysfs_create_groups(&pdev->dev.kobj, uart_groups);
 	if (ret) {
 		dev_err(&pdev->dev, "Failed to create sysfs attributes\n");
-		return ret;
+		goto destroy_wq;
 	}
 
 	/* apba_ctrl must be probed and initialized */
@@ -529,6 +778,8 @@ static int mods_uart_probe(struct platform_device *pdev)
 
 remove_sysfs:
 	sysfs_remove_groups(&pdev->dev.kobj, uart_groups);
+destroy_wq:
+	destroy_workqueue(mud->tx_wq);
 
 	return ret;
 }
@@ -540,6 +791,7 @@ static int mods_uart_remove(struct platform_device *pdev)
 	apba_uart_register(NULL);
 	sysfs_remove_groups(&pdev->dev.kobj, uart_groups);
 	mods_uart_close(mud);
+	destroy_workqueue(mud->tx_wq);
 	platform_set_drvdata(pdev, NULL);
 
 	return 0;
@@ -559,71 +811,129 @@ static struct platform_driver mods_uart_driver = {
 	},
 };
 
+static inline size_t mods_uart_rx_used(struct mods_uart_data *mud)
+{
+	return mud->rx_head - mud->rx_tail;
+}
+
+/* Copy len bytes starting at the read index, handling the wrap */
+static void mods_uart_rx_peek(struct mods_uart_data *mud, void *dst,
+			      size_t len)
+{
+	unsigned int start = mud->rx_tail & MODS_UART_RX_RING_MASK;
+	size_t first = MIN(len, MODS_UART_RX_RING_SIZE - start);
+
+	memcpy(dst, &mud->rx_ring[start], first);
+	memcpy((uint8_t *)dst + first, mud->rx_ring, len - first);
+}
+
+/*
+ * Return a contiguous view of len bytes at the read index. Only segments
+ * that wrap around the end of the ring are copied, into the bounce buffer.
+ */
+static uint8_t *mods_uart_rx_linear(struct mods_uart_data *mud, size_t len)
+{
+	unsigned int start = mud->rx_tail & MODS_UART_RX_RING_MASK;
+
+	if (start + len <= MODS_UART_RX_RING_SIZE)
+		return &mud->rx_ring[start];
+
+	mods_uart_rx_peek(mud, mud->rx_bounce, len);
+	return mud->rx_bounce;
+}
+
+static void mods_uart_rx_write(struct mods_uart_data *mud,
+			       const uint8_t *src, size_t len)
+{
+	unsigned int start = mud->rx_head & MODS_UART_RX_RING_MASK;
+	size_t first = MIN(len, MODS_UART_RX_RING_SIZE - start);
+
+	memcpy(&mud->rx_ring[start], src, first);
+	memcpy(mud->rx_ring, src + first, len - first);
+	mud->rx_head += len;
+}
+
+/*
+ * On a bad length or CRC, skip one byte and look for the next header
+ * instead of dropping everything received. Errors are only reported for
+ * the first failure until the stream is back in sync.
+ */
+static void mods_uart_rx_resync(struct mods_uart_data *mud)
+{
+	mud->rx_resync = true;
+	mud->rx_tail++;
+}
+
 static int mods_uart_consume_segment(struct mods_uart_data *mud)
 {
 	struct device *dev = &mud->pdev->dev;
 	uint16_t calc_crc;
-	uint16_t *rcvd_crc;
+	uint16_t rcvd_crc;
+	struct mhb_hdr peek_hdr;
 	struct mhb_hdr *hdr;
+	uint8_t *segment;
 	uint8_t *payload;
 	size_t content_size;
 	size_t segment_size;
 
-	if (mud->rx_len < sizeof(*hdr))
+	if (mods_uart_rx_used(mud) < sizeof(*hdr))
 		return 0;
 
-	hdr = (struct mhb_hdr *) mud->rx_data;
-	segment_size = le16_to_cpu(hdr->length);
+	mods_uart_rx_peek(mud, &peek_hdr, sizeof(peek_hdr));
+	segment_size = le16_to_cpu(peek_hdr.length);
 	if ((segment_size < sizeof(struct mhb_hdr) + sizeof(calc_crc)) ||
 	    (segment_size > MHB_MAX_MSG_SIZE)) {
-		mud->stats.rx_len++;
-		dev_err(dev, "%s: invalid len %zd\n", __func__, segment_size);
+		if (!mud->rx_resync) {
+			mud->stats.rx_len++;
+			dev_err(dev, "%s: invalid len %zd\n", __func__,
+				segment_size);
+		}
 
-		mud->rx_len = 0;
-		return 0;
+		mods_uart_rx_resync(mud);
+		return 1;
 	}
 
 	content_size = segment_size - sizeof(calc_crc);
 
-	if (mud->rx_len < segment_size)
+	if (mods_uart_rx_used(mud) < segment_size)
 		return 0;
 
-	rcvd_crc = (uint16_t *)&mud->rx_data[content_size];
-	calc_crc = crc16(0, (uint8_t *) mud->rx_data, content_size);
-	if (le16_to_cpu(*rcvd_crc) != calc_crc) {
-		mud->stats.rx_crc++;
-		print_hex_dump_debug("RX (CRC error): ", DUMP_PREFIX_OFFSET,
-			16, 1, mud->rx_data, content_size, true);
-		dev_err(dev, "%s: CRC mismatch, received: 0x%x, "
-			"calculated: 0x%x\n", __func__,
-			le16_to_cpu(*rcvd_crc), calc_crc);
-
-		/*
-		 * Not sure what is best to return in this case. Since the
-		 * entire buf was technically received and parsed, return the
-		 * total count.
-		 */
-		mud->rx_len = 0;
-		return 0;
-	} else {
-		payload = ((uint8_t *)mud->rx_data) + sizeof(*hdr);
-		pr_debug("MHB RX: addr=%x, type=%x, result=%x, len=%zd\n",
-			hdr->addr, hdr->type, hdr->result, content_size);
+	segment = mods_uart_rx_linear(mud, segment_size);
+	rcvd_crc = get_unaligned_le16(&segment[content_size]);
+	calc_crc = crc16_mhb(0, segment, content_size);
+	if (rcvd_crc != calc_crc) {
+		if (!mud->rx_resync) {
+			mud->stats.rx_crc++;
+			print_hex_dump_debug("RX (CRC error): ",
+				DUMP_PREFIX_OFFSET, 16, 1, segment,
+				content_size, true);
+			dev_err(dev, "%s: CRC mismatch, received: 0x%x, "
+				"calculated: 0x%x\n", __func__,
+				rcvd_crc, calc_crc);
+		}
 
-		print_hex_dump_debug("MHB RX: ", DUMP_PREFIX_OFFSET, 16, 1,
-			payload, content_size - sizeof(*hdr), true);
-		apba_handle_message(hdr, payload, content_size - sizeof(*hdr));
+		mods_uart_rx_resync(mud);
+		return 1;
 	}
 
-	mud->rx_len -= segment_size;
-
-	if (mud->rx_len) {
-		memmove(mud->rx_data, mud->rx_data + segment_size,
-			mud->rx_len);
-		/* more data to consume */
-		return 1;
+	if (mud->rx_resync) {
+		dev_info(dev, "%s: RX resynchronized\n", __func__);
+		mud->rx_resync = false;
 	}
-	return 0;
+
+	hdr = (struct mhb_hdr *)segment;
+	payload = segment + sizeof(*hdr);
+	pr_debug("MHB RX: addr=%x, type=%x, result=%x, len=%zd\n",
+		hdr->addr, hdr->type, hdr->result, content_size);
+
+	print_hex_dump_debug("MHB RX: ", DUMP_PREFIX_OFFSET, 16, 1,
+		payload, content_size - sizeof(*hdr), true);
+	apba_handle_message(hdr, payload, content_size - sizeof(*hdr));
+
+	mud->rx_tail += segment_size;
+
+	/* more data to consume */
+	return 1;
 }
 
 static int n_mods_uart_receive_buf2(struct tty_struct *tty,
@@ -641,46 +951,42 @@ static int n_mods_uart_receive_buf2(struct tty_struct *tty,
 	 * Try to clean up garbage/incomplete chars received
 	 * for some reason.
 	 */
-	if (mud->rx_len &&
+	if (mods_uart_rx_used(mud) &&
 	    (jiffies_to_msecs(jiffies - mud->last_rx) >
 	     MODS_UART_SEGMENT_TIMEOUT)) {
 		mud->stats.rx_timeout++;
-		print_hex_dump_debug("RX (timeout): ", DUMP_PREFIX_OFFSET,
-			16, 1, mud->rx_data, mud->rx_len, true);
 		dev_err(dev, "%s: RX Buffer cleaned up\n", __func__);
-		mud->rx_len = 0;
+		mud->rx_tail = mud->rx_head;
+		mud->rx_resync = false;
 	}
 	mud->last_rx = jiffies;
 
 	while (to_be_consumed > 0) {
 		int copy_size;
 
-		if (mud->rx_len == MHB_MAX_MSG_SIZE) {
+		if (mods_uart_rx_used(mud) == MODS_UART_RX_RING_SIZE) {
 			/*
-			 * buffer is already left full, not consumed.
-			 * Something is wrong. Need to reset the buffer
-			 * to proceed
+			 * Ring is left full, not consumed. Something is
+			 * wrong. Need to reset the buffer to proceed.
 			 */
 			/*
 			 * TODO: Send a break signa to APBA to reset
 			 *       UART status.
 			 */
 			mud->stats.rx_abort++;
-			print_hex_dump_debug("RX (overflow): ",
-				DUMP_PREFIX_OFFSET, 16, 1,
-				mud->rx_data, mud->rx_len, true);
 			dev_err(dev, "%s: RX buffer overflow\n", __func__);
-			mud->rx_len = 0;
+			mud->rx_tail = mud->rx_head;
+			mud->rx_resync = false;
 		}
 
 		copy_size = MIN(to_be_consumed,
-				MHB_MAX_MSG_SIZE - mud->rx_len);
+				MODS_UART_RX_RING_SIZE - mods_uart_rx_used(mud));
 
-		memcpy(&mud->rx_data[mud->rx_len], cp, copy_size);
-		mud->rx_len += copy_size;
+		mods_uart_rx_write(mud, cp, copy_size);
 
 		do {} while (mods_uart_consume_segment(mud));
 
+		cp += copy_size;
 		to_be_consumed -= copy_size;
 	}
 	mods_uart_pm_update_idle_timer(mud->mods_uart_pm_data);
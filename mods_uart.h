@@ -24,8 +24,13 @@ int mods_uart_close(void *uart_data);
 int mods_uart_do_pm(void *uart_data, bool on);
 void *mods_uart_get_pm_data(void *uart_data);
 
+typedef void (*mods_uart_tx_complete_t)(void *ctx, int result);
+
 int mods_uart_send(void *uart_data, struct mhb_hdr *hdr,
 	uint8_t *buf, size_t len, int flag);
+int mods_uart_send_async(void *uart_data, struct mhb_hdr *hdr,
+	uint8_t *buf, size_t len, int flag,
+	mods_uart_tx_complete_t done_cb, void *ctx);
 
 int mods_uart_get_baud(void *uart_data);
 /* Lock the UART while setting the baud. */
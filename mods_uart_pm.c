@@ -11,8 +11,12 @@
  * GNU General Public License for more details.
  */
 
+#include <linux/kernel.h>
+#include <linux/ktime.h>
+#include <linux/module.h>
 #include <linux/mutex.h>
 #include <linux/slab.h>
+#include <linux/spinlock.h>
 #include <linux/timer.h>
 #include <linux/workqueue.h>
 
@@ -21,6 +25,14 @@
 #include "mods_uart_pm.h"
 #include "mhb_protocol.h"
 
+struct mods_uart_pm_stats {
+	uint32_t wake_handshakes;
+	uint32_t wake_timeouts;
+	uint32_t sleep_reqs;
+	uint32_t wake_ms_last;
+	uint32_t wake_ms_max;
+};
+
 struct mods_uart_pm_data {
 	void *mods_uart_data;
 	bool on;
@@ -30,18 +42,125 @@ struct mods_uart_pm_data {
 	struct completion pm_handshake_comp;
 	struct work_struct idle_timer_work;
 	struct timer_list idle_timer;
+
+	/* Idle policy, protected by policy_lock */
+	spinlock_t policy_lock;
+	ktime_t last_activity;
+	unsigned int gap_ewma_ms;
+	unsigned int gap_samples;
+	unsigned int wake_ewma_ms;
+	unsigned int idle_timeout_ms;
+	struct mods_uart_pm_stats stats;
 };
 
 #define MODS_UART_PM_HANDSHAKE_TIMEOUT	1000 /* ms */
 #define MODS_UART_PM_IDLE_TIMEOUT	2000 /* msec */
 
+/*
+ * Adaptive idle policy. Activity separated by more than BURST_GAP is a new
+ * burst, and the gap before it is folded into an EWMA (weight 1/EWMA_DIV).
+ * If the typical gap is short compared with what a wake handshake costs
+ * (BREAK_EVEN times its latency), the link is kept up long enough to
+ * bridge the gap. Otherwise it is put to sleep after MIN_IDLE_TIMEOUT.
+ */
+#define MODS_UART_PM_BURST_GAP		10   /* msec */
+#define MODS_UART_PM_MIN_IDLE_TIMEOUT	100  /* msec */
+#define MODS_UART_PM_EWMA_DIV		8
+#define MODS_UART_PM_MIN_SAMPLES	4
+#define MODS_UART_PM_BREAK_EVEN		20
+
+static bool uart_pm_adaptive_idle = true;
+module_param(uart_pm_adaptive_idle, bool, 0644);
+MODULE_PARM_DESC(uart_pm_adaptive_idle,
+		 "Pick the APBA UART idle timeout from traffic history");
+
+static unsigned int mods_uart_pm_ewma(unsigned int avg, unsigned int sample)
+{
+	return (avg * (MODS_UART_PM_EWMA_DIV - 1) + sample) /
+		MODS_UART_PM_EWMA_DIV;
+}
+
+/* Must be called with policy_lock held */
+static unsigned int mods_uart_pm_pick_idle_timeout(
+	struct mods_uart_pm_data *data)
+{
+	unsigned int break_even;
+	unsigned int wake_ms;
+
+	if (!uart_pm_adaptive_idle ||
+	    data->gap_samples < MODS_UART_PM_MIN_SAMPLES)
+		return MODS_UART_PM_IDLE_TIMEOUT;
+
+	/* Until a handshake has been timed, assume the worst case */
+	wake_ms = data->stats.wake_handshakes ? data->wake_ewma_ms :
+		MODS_UART_PM_HANDSHAKE_TIMEOUT;
+	break_even = max(wake_ms, 1U) * MODS_UART_PM_BREAK_EVEN;
+
+	if (data->gap_ewma_ms < break_even)
+		return clamp_t(unsigned int, 2 * data->gap_ewma_ms,
+			       MODS_UART_PM_MIN_IDLE_TIMEOUT,
+			       MODS_UART_PM_IDLE_TIMEOUT);
+
+	return MODS_UART_PM_MIN_IDLE_TIMEOUT;
+}
+
 void mods_uart_pm_update_idle_timer(void *uart_pm_data)
 {
 	struct mods_uart_pm_data *data;
+	unsigned int timeout_ms;
+	unsigned long flags;
+	ktime_t now = ktime_get();
+	s64 gap_ms;
+
+	data = (struct mods_uart_pm_data *)uart_pm_data;
+
+	spin_lock_irqsave(&data->policy_lock, flags);
+
+	gap_ms = ktime_to_ms(ktime_sub(now, data->last_activity));
+	if (ktime_to_ns(data->last_activity) &&
+	    gap_ms >= MODS_UART_PM_BURST_GAP) {
+		/* Clamp so one long idle period does not swamp the average */
+		gap_ms = min_t(s64, gap_ms, 4 * MODS_UART_PM_IDLE_TIMEOUT);
+		data->gap_ewma_ms = data->gap_samples ?
+			mods_uart_pm_ewma(data->gap_ewma_ms, gap_ms) : gap_ms;
+		data->gap_samples++;
+	}
+	data->last_activity = now;
+
+	timeout_ms = mods_uart_pm_pick_idle_timeout(data);
+	data->idle_timeout_ms = timeout_ms;
+
+	spin_unlock_irqrestore(&data->policy_lock, flags);
+
+	mod_timer(&data->idle_timer, jiffies + msecs_to_jiffies(timeout_ms));
+}
+
+ssize_t mods_uart_pm_stats_show(void *uart_pm_data, char *buf)
+{
+	struct mods_uart_pm_data *data;
+	struct mods_uart_pm_stats stats;
+	unsigned int gap_ewma_ms;
+	unsigned int wake_ewma_ms;
+	unsigned int idle_timeout_ms;
+	unsigned long flags;
 
 	data = (struct mods_uart_pm_data *)uart_pm_data;
-	mod_timer(&data->idle_timer,
-		  jiffies + msecs_to_jiffies(MODS_UART_PM_IDLE_TIMEOUT));
+
+	spin_lock_irqsave(&data->policy_lock, flags);
+	stats = data->stats;
+	gap_ewma_ms = data->gap_ewma_ms;
+	wake_ewma_ms = data->wake_ewma_ms;
+	idle_timeout_ms = data->idle_timeout_ms;
+	spin_unlock_irqrestore(&data->policy_lock, flags);
+
+	return scnprintf(buf, PAGE_SIZE,
+			 "wake handshakes:%u, wake timeouts:%u, "
+			 "wake ms last:%u, wake ms avg:%u, wake ms max:%u, "
+			 "sleep reqs:%u, burst gap ms avg:%u, "
+			 "idle timeout ms:%u\n",
+			 stats.wake_handshakes, stats.wake_timeouts,
+			 stats.wake_ms_last, wake_ewma_ms, stats.wake_ms_max,
+			 stats.sleep_reqs, gap_ewma_ms, idle_timeout_ms);
 }
 
 static void idle_timer_callback(unsigned long timer_data)
@@ -99,10 +218,16 @@ static void local_pm_update(struct mods_uart_pm_data *data, bool on)
  */
 static void apba_pm_wake_handshake(struct mods_uart_pm_data *data)
 {
+	unsigned long flags;
+	ktime_t start;
+	bool timeout = false;
+	uint32_t wake_ms;
+
 	pr_debug("%s: wake handshake\n", __func__);
 	mutex_lock(&data->pm_handshake_mutex);
 
 	/* Wake INT then wait for an ack message. */
+	start = ktime_get();
 	apba_wake_assert(true);
 
 	if (!wait_for_completion_timeout(
@@ -110,8 +235,21 @@ static void apba_pm_wake_handshake(struct mods_uart_pm_data *data)
 		    msecs_to_jiffies(MODS_UART_PM_HANDSHAKE_TIMEOUT))) {
 		pr_err("%s: WAKE HANDSHAKE () timeout\n", __func__);
 		apba_wake_assert(false);
+		timeout = true;
 	}
 
+	wake_ms = ktime_to_ms(ktime_sub(ktime_get(), start));
+
+	spin_lock_irqsave(&data->policy_lock, flags);
+	data->wake_ewma_ms = data->stats.wake_handshakes ?
+		mods_uart_pm_ewma(data->wake_ewma_ms, wake_ms) : wake_ms;
+	data->stats.wake_handshakes++;
+	data->stats.wake_ms_last = wake_ms;
+	data->stats.wake_ms_max = max(data->stats.wake_ms_max, wake_ms);
+	if (timeout)
+		data->stats.wake_timeouts++;
+	spin_unlock_irqrestore(&data->policy_lock, flags);
+
 	mutex_unlock(&data->pm_handshake_mutex);
 	pr_debug("%s: wake attempt done\n", __func__);
 }
@@ -161,7 +299,8 @@ void mods_uart_pm_pre_tx(void *uart_pm_data, int flag)
 /*
  * Called in context of UART TX, after TX chunks is sent out.
  * All UART TX request has been blocked in caller function while
- * executing this function.
+ * executing this function. The idle timer is armed by the caller once
+ * the whole TX burst has gone out.
  */
 void mods_uart_pm_post_tx(void *uart_pm_data, int flag)
 {
@@ -177,13 +316,12 @@ void mods_uart_pm_post_tx(void *uart_pm_data, int flag)
 	 */
 	if (flag == UART_PM_FLAG_SLEEP_IND)
 		atomic_set(&data->pm_state_remote, 0);
-
-	mods_uart_pm_update_idle_timer(data);
 }
 
 static void idle_timeout_work_func(struct work_struct *work)
 {
 	struct mods_uart_pm_data *data;
+	unsigned long flags;
 
 	data = container_of(work, struct mods_uart_pm_data, idle_timer_work);
 	if (!data)
@@ -202,6 +340,10 @@ static void idle_timeout_work_func(struct work_struct *work)
 		return;
 	}
 
+	spin_lock_irqsave(&data->policy_lock, flags);
+	data->stats.sleep_reqs++;
+	spin_unlock_irqrestore(&data->policy_lock, flags);
+
 	if (apba_send_pm_sleep_req())
 		mods_uart_pm_update_idle_timer(data);
 }
@@ -246,6 +388,8 @@ void *mods_uart_pm_initialize(void *uart_data)
 
 	mutex_init(&data->pm_handshake_mutex);
 	init_completion(&data->pm_handshake_comp);
+	spin_lock_init(&data->policy_lock);
+	data->idle_timeout_ms = MODS_UART_PM_IDLE_TIMEOUT;
 
 	INIT_WORK(&data->idle_timer_work, idle_timeout_work_func);
 
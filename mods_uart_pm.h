@@ -22,6 +22,7 @@ void mods_uart_pm_on(void *uart_data, bool on);
 void mods_uart_pm_handle_wake_interrupt(void *uart_data);
 
 void mods_uart_pm_update_idle_timer(void *uart_pm_data);
+ssize_t mods_uart_pm_stats_show(void *uart_pm_data, char *buf);
 
 void mods_uart_pm_pre_tx(void *uart_pm_data, int flag);
 void mods_uart_pm_post_tx(void *uart_pm_data, int flag);
@@ -17,10 +17,14 @@
 #include <linux/delay.h>
 #include <linux/err.h>
 #include <linux/interrupt.h>
+#include <linux/ktime.h>
 #include <linux/log2.h>
+#include <linux/mm.h>
 #include <linux/module.h>
 #include <linux/mutex.h>
 #include <linux/of_irq.h>
+#include <linux/sched.h>
+#include <linux/seq_file.h>
 #include <linux/spi/spi.h>
 #include <linux/wait.h>
 #include <linux/workqueue.h>
@@ -99,10 +103,45 @@
 
 #define RDY_TIMEOUT_JIFFIES     (HZ /  4) /* 250 milliseconds */
 #define ACK_TIMEOUT_JIFFIES     (HZ / 10) /* 100 milliseconds */
+#define RESIZE_TIMEOUT_JIFFIES  (HZ /  2) /* 500 milliseconds */
 
 /* The number of times to try sending a datagram to the MuC */
 #define NUM_TRIES      (3)
 
+/*
+ * Minimum payload (in bytes) for the caller's buffer to be transmitted in
+ * place. Below this, copying into the packet buffer is cheaper than the
+ * extra transfer segments.
+ */
+#define TX_IN_PLACE_MIN    (128)
+
+/* Maximum number of spi_transfer segments used for one packet */
+#define MAX_XFERS_PER_PKT  (3)
+
+/*
+ * Link tuning parameters. Every TUNE_PERIOD_JIFFIES the CRC and ACK failure
+ * rate of the window is checked. Above TUNE_ERR_HIGH (per thousand packets)
+ * the bus is slowed down by a quarter, and after TUNE_CLEAN_WINDOWS windows
+ * without errors it is sped back up, never exceeding the negotiated speed
+ * or dropping below 1/TUNE_MIN_SPEED_DIV of it.
+ */
+#define TUNE_PERIOD_JIFFIES     (HZ)
+#define TUNE_MIN_PKTS           (32)
+#define TUNE_ERR_HIGH           (10)
+#define TUNE_CLEAN_WINDOWS      (5)
+#define TUNE_MIN_SPEED_DIV      (8)
+#define TUNE_PKT_WINDOWS        (3)
+
+/* Off by default, the MuC is not told when the bus speed changes */
+static bool adaptive_speed;
+module_param(adaptive_speed, bool, 0644);
+MODULE_PARM_DESC(adaptive_speed, "Tune SPI bus speed from link errors");
+
+/* Requires MuC firmware that accepts a bus config request while attached */
+static bool adaptive_pkt_size;
+module_param(adaptive_pkt_size, bool, 0644);
+MODULE_PARM_DESC(adaptive_pkt_size, "Renegotiate SPI packet size from traffic");
+
 #define MIN(a, b) (((a) < (b)) ? (a) : (b))
 
 /*
@@ -116,6 +155,27 @@
 			d->present);                                \
 	}
 
+/*
+ * Latency histograms use log2 buckets of microseconds. Bucket 0 counts
+ * durations below 1us, bucket n counts [2^(n-1), 2^n) us and the last
+ * bucket everything above.
+ */
+#define STATS_HIST_BUCKETS  (16)
+
+struct muc_spi_stats {
+	uint64_t tx_bytes;                 /* Payload bytes sent */
+	uint64_t rx_bytes;                 /* Payload bytes received */
+	uint32_t tx_pkts;                  /* Valid packets sent */
+	uint32_t rx_pkts;                  /* Valid packets received */
+	uint32_t tx_dummy;                 /* Dummy packets sent */
+	uint32_t rx_dummy;                 /* Dummy packets received */
+	uint32_t crc_errs;                 /* Received packets with bad CRC */
+	uint32_t retries;                  /* Packet transfers retried */
+	uint32_t rdy_wait[STATS_HIST_BUCKETS];  /* WAKE to RDY latency */
+	uint32_t ack_wait[STATS_HIST_BUCKETS];  /* Transfer to ACK latency */
+	uint32_t xfer_time[STATS_HIST_BUCKETS]; /* spi_sync_transfer duration */
+};
+
 typedef int (*handler_t)(struct mods_dl_device *from, uint8_t *msg, size_t len);
 
 enum ack {
@@ -158,6 +218,21 @@ struct muc_spi_data {
 	uint32_t no_ack_sent;              /* Number of times no ACK was sent */
 	uint32_t no_ack_rcvd;              /* Number of times no ACK was received */
 	uint32_t no_ack_abort;             /* Number of times transfer was aborted */
+	struct muc_spi_stats stats;        /* Link statistics */
+
+	/* Link tuning below */
+	struct delayed_work tune_work;     /* Periodic link tuning worker */
+	__u32 max_speed_hz;                /* Max bus speed agreed with MuC */
+	size_t max_pkt_size;               /* Max packet size agreed with MuC */
+	bool pkt_size_pending;             /* Packet size change requested */
+	wait_queue_head_t pkt_size_wq;     /* Wait for packet size change */
+	uint32_t tune_pkts;                /* Valid packets in this window */
+	uint32_t tune_errs;                /* CRC/ACK failures in this window */
+	uint32_t tune_tx_dgs;              /* TX datagrams in this window */
+	uint32_t tune_tx_bytes;            /* TX datagram bytes in this window */
+	uint8_t tune_clean_windows;        /* Consecutive error free windows */
+	uint8_t tune_pkt_windows;          /* Windows favouring new pkt size */
+	size_t tune_pkt_target;            /* Packet size favoured by traffic */
 
 	/* Quirks below */
 	bool wake_delay;                   /* Delay after wake assert is req'd */
@@ -218,6 +293,45 @@ static inline void set_tx_pkt_crc(struct muc_spi_data *dd)
 	*crc = cpu_to_le16(*crc);
 }
 
+/*
+ * Calculate the CRC for a packet whose payload is sent from the caller's
+ * buffer. The header, padding and CRC remain in the packet buffer.
+ */
+static inline void set_tx_pkt_crc_split(struct muc_spi_data *dd,
+					const uint8_t *pl, size_t pl_len)
+{
+	uint16_t *crc = (uint16_t *)&dd->tx_pkt[CRC_NDX(dd->pkt_size)];
+	size_t pad_ndx = HDR_SIZE + pl_len;
+	uint16_t calc;
+
+	calc = crc16_calc(0, dd->tx_pkt, HDR_SIZE);
+	calc = crc16_calc(calc, pl, pl_len);
+	calc = crc16_calc(calc, &dd->tx_pkt[pad_ndx],
+			  CRC_NDX(dd->pkt_size) - pad_ndx);
+	*crc = cpu_to_le16(calc);
+}
+
+/*
+ * The caller's buffer can only be handed to the SPI controller when it is
+ * DMA-safe, and is only worth it when large enough to save a real copy.
+ */
+static inline bool can_tx_in_place(const uint8_t *buf, size_t len)
+{
+	return (len >= TX_IN_PLACE_MIN) && virt_addr_valid(buf) &&
+		!object_is_on_stack(buf);
+}
+
+static void stats_hist_add(uint32_t *hist, ktime_t start)
+{
+	s64 us = ktime_us_delta(ktime_get(), start);
+	int bucket = 0;
+
+	if (us > 0)
+		bucket = min(ilog2(us) + 1, STATS_HIST_BUCKETS - 1);
+
+	hist[bucket]++;
+}
+
 static void set_bus_speed(struct muc_spi_data *dd, __u32 max_speed_hz)
 {
 	struct spi_device *spi = dd->spi;
@@ -261,6 +375,34 @@ static int set_packet_size(struct muc_spi_data *dd, size_t pkt_size)
 	return 0;
 }
 
+/* Apply a packet size change requested by the link tuning worker */
+static int dl_recv_pkt_resize(struct muc_spi_data *dd, size_t pl_size)
+{
+	struct device *dev = &dd->spi->dev;
+	int ret;
+
+	dd->pkt_size_pending = false;
+	wake_up_all(&dd->pkt_size_wq);
+
+	if (!pl_size)
+		return 0;
+
+	if (pl_size == U16_MAX)
+		pl_size++;
+
+	if (PKT_SIZE(pl_size) > dd->max_pkt_size) {
+		dev_err(dev, "Packet size %zu above negotiated limit\n",
+			PKT_SIZE(pl_size));
+		return -EINVAL;
+	}
+
+	ret = set_packet_size(dd, PKT_SIZE(pl_size));
+	if (ret)
+		dev_err(dev, "Error (%d) resizing packets\n", ret);
+
+	return ret;
+}
+
 static int dl_recv(struct mods_dl_device *dld, uint8_t *msg, size_t len)
 {
 	struct muc_spi_data *dd = dld_to_dd(dld);
@@ -283,14 +425,17 @@ static int dl_recv(struct mods_dl_device *dld, uint8_t *msg, size_t len)
 		return -EINVAL;
 	}
 
+	max_speed = le32_to_cpu(resp.bus_resp.max_speed);
+	pl_size = le16_to_cpu(resp.bus_resp.pl_size);
+
 	if (dd->attached) {
+		if (dd->pkt_size_pending)
+			return dl_recv_pkt_resize(dd, pl_size);
+
 		dev_warn(&dd->spi->dev, "Trying to reconfigure bus!\n");
 		return -EINVAL;
 	}
 
-	max_speed = le32_to_cpu(resp.bus_resp.max_speed);
-	pl_size = le16_to_cpu(resp.bus_resp.pl_size);
-
 	/* Ignore max_bus_speed if zero and continue to use default speed */
 	if (max_speed > 0)
 		set_bus_speed(dd, max_speed);
@@ -325,6 +470,10 @@ static int dl_recv(struct mods_dl_device *dld, uint8_t *msg, size_t len)
 	dev_info(dev, "proto_ver=%d, ack_supported=%d\n",
 		 dd->proto_ver, dd->ack_supported);
 
+	/* Save the negotiated limits for link tuning */
+	dd->max_speed_hz = dd->spi->max_speed_hz;
+	dd->max_pkt_size = dd->pkt_size;
+
 	/* Schedule work to send attach to SVC */
 	schedule_work(&dd->attach_work);
 
@@ -342,29 +491,226 @@ static void attach_worker(struct work_struct *work)
 		return;
 
 	ret = mods_dl_dev_attached(dd->dld);
-	if (ret)
+	if (ret) {
 		dev_err(&dd->spi->dev, "Error (%d) attaching to SVC\n", ret);
-	else
-		dd->attached = true;
+		return;
+	}
+
+	dd->attached = true;
+}
+
+/*
+ * The SVC finished the attach started by attach_worker(). A failed attach
+ * has been unwound and recovery started by the SVC, so it is only logged.
+ * Detach waits for an attach in progress, so tune_work is cancelled only
+ * once mods_dl_dev_detached() has returned.
+ */
+static void muc_spi_attach_done(struct mods_dl_device *dld, int err)
+{
+	struct muc_spi_data *dd = dld_to_dd(dld);
+
+	if (err) {
+		dev_err(&dd->spi->dev, "SVC attach failed: %d\n", err);
+		return;
+	}
+
+	schedule_delayed_work(&dd->tune_work, TUNE_PERIOD_JIFFIES);
+}
+
+static int request_pkt_size(struct muc_spi_data *dd, size_t pkt_size)
+{
+	size_t pl_size = PL_SIZE(pkt_size);
+	struct spi_dl_msg msg;
+	int err;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.id = DL_MSG_ID_BUS_CFG_REQ;
+	msg.bus_req.max_pl_size = cpu_to_le16(min_t(size_t, pl_size, U16_MAX));
+	msg.bus_req.version = PROTO_VER;
+
+	if (dd->ack_supported)
+		msg.bus_req.features |= DL_BIT_ACK;
+
+	dd->pkt_size_pending = true;
+	err = __muc_spi_message_send(dd, MSG_TYPE_DL, (uint8_t *)&msg,
+				     sizeof(msg));
+	if (err) {
+		dd->pkt_size_pending = false;
+		wake_up_all(&dd->pkt_size_wq);
+	}
+
+	return err;
+}
+
+/* Must be called with the mutex held */
+static void tune_bus_speed(struct muc_spi_data *dd)
+{
+	__u32 speed = dd->spi->max_speed_hz;
+	__u32 min_speed = dd->max_speed_hz / TUNE_MIN_SPEED_DIV;
+
+	if (dd->tune_pkts < TUNE_MIN_PKTS)
+		return;
+
+	if ((dd->tune_errs * 1000 / dd->tune_pkts) > TUNE_ERR_HIGH) {
+		dd->tune_clean_windows = 0;
+		if (speed <= min_speed)
+			return;
+
+		speed = max(speed - speed / 4, min_speed);
+	} else if (!dd->tune_errs) {
+		if (++dd->tune_clean_windows < TUNE_CLEAN_WINDOWS ||
+		    speed >= dd->max_speed_hz)
+			return;
+
+		dd->tune_clean_windows = 0;
+		speed = min(speed + speed / 4, dd->max_speed_hz);
+	} else {
+		return;
+	}
+
+	dev_dbg(&dd->spi->dev, "Link tuning: %u errors in %u packets\n",
+		dd->tune_errs, dd->tune_pkts);
+	set_bus_speed(dd, speed);
+}
+
+/*
+ * Pick the packet size best suited to the TX traffic of the last window:
+ * the smallest power of two payload that fits the average datagram, so
+ * bulk traffic moves to larger packets and control traffic to smaller
+ * ones. Returns zero if no change should be requested. Must be called
+ * with the mutex held.
+ */
+static size_t tune_pkt_size(struct muc_spi_data *dd)
+{
+	size_t avg;
+	size_t target;
+
+	if (dd->tune_tx_dgs < TUNE_MIN_PKTS)
+		return 0;
+
+	avg = dd->tune_tx_bytes / dd->tune_tx_dgs;
+	target = PKT_SIZE(roundup_pow_of_two(max_t(size_t, avg, 1)));
+	target = clamp_t(size_t, target, DEFAULT_PKT_SZ, dd->max_pkt_size);
+
+	if (target == dd->pkt_size || !is_power_of_2(PL_SIZE(target))) {
+		dd->tune_pkt_windows = 0;
+		return 0;
+	}
+
+	/* Require the same target for several windows before switching */
+	if (target != dd->tune_pkt_target) {
+		dd->tune_pkt_target = target;
+		dd->tune_pkt_windows = 0;
+	}
+
+	if (++dd->tune_pkt_windows < TUNE_PKT_WINDOWS)
+		return 0;
+
+	dd->tune_pkt_windows = 0;
+	return target;
+}
+
+static void tune_worker(struct work_struct *work)
+{
+	struct muc_spi_data *dd = container_of(to_delayed_work(work),
+					       struct muc_spi_data, tune_work);
+	size_t pkt_size = 0;
+
+	if (!dd->attached)
+		return;
+
+	mutex_lock(&dd->mutex);
+
+	if (adaptive_speed)
+		tune_bus_speed(dd);
+
+	if (adaptive_pkt_size && !dd->pkt_size_pending)
+		pkt_size = tune_pkt_size(dd);
+
+	dd->tune_pkts = 0;
+	dd->tune_errs = 0;
+	dd->tune_tx_dgs = 0;
+	dd->tune_tx_bytes = 0;
+
+	mutex_unlock(&dd->mutex);
+
+	if (pkt_size) {
+		dev_info(&dd->spi->dev, "Link tuning: request %zu byte packets\n",
+			 pkt_size);
+		if (request_pkt_size(dd, pkt_size))
+			dev_err(&dd->spi->dev, "Packet size request failed\n");
+	}
+
+	schedule_delayed_work(&dd->tune_work, TUNE_PERIOD_JIFFIES);
+}
+
+static void tune_reset(struct muc_spi_data *dd)
+{
+	dd->max_speed_hz = dd->default_speed_hz;
+	dd->max_pkt_size = DEFAULT_PKT_SZ;
+	dd->pkt_size_pending = false;
+	wake_up_all(&dd->pkt_size_wq);
+	dd->tune_pkts = 0;
+	dd->tune_errs = 0;
+	dd->tune_tx_dgs = 0;
+	dd->tune_tx_bytes = 0;
+	dd->tune_clean_windows = 0;
+	dd->tune_pkt_windows = 0;
+	dd->tune_pkt_target = 0;
+}
+
+/*
+ * Setup the transfer segments for one packet. If a separate TX payload is
+ * given, the header, payload and padding + CRC go out as three segments of
+ * the same message, otherwise the whole packet is sent from tx_pkt.
+ */
+static int setup_pkt_xfers(struct muc_spi_data *dd, struct spi_transfer *t,
+			   const uint8_t *tx_pl, size_t tx_pl_len)
+{
+	size_t tail_ndx = HDR_SIZE + tx_pl_len;
+
+	memset(t, 0, MAX_XFERS_PER_PKT * sizeof(*t));
+
+	if (!tx_pl) {
+		t[0].tx_buf = dd->tx_pkt;
+		t[0].rx_buf = dd->rx_pkt;
+		t[0].len = dd->pkt_size;
+		return 1;
+	}
+
+	t[0].tx_buf = dd->tx_pkt;
+	t[0].rx_buf = dd->rx_pkt;
+	t[0].len = HDR_SIZE;
+
+	t[1].tx_buf = tx_pl;
+	t[1].rx_buf = &dd->rx_pkt[HDR_SIZE];
+	t[1].len = tx_pl_len;
+
+	t[2].tx_buf = &dd->tx_pkt[tail_ndx];
+	t[2].rx_buf = &dd->rx_pkt[tail_ndx];
+	t[2].len = dd->pkt_size - tail_ndx;
+
+	return 3;
 }
 
-static int muc_spi_transfer(struct muc_spi_data *dd, bool keep_wake)
+static int muc_spi_transfer(struct muc_spi_data *dd, bool keep_wake,
+			    const uint8_t *tx_pl, size_t tx_pl_len)
 {
 	struct spi_device *spi = dd->spi;
-	struct spi_transfer t[] = {
-		{
-			.tx_buf = dd->tx_pkt,
-			.rx_buf = dd->rx_pkt,
-			.len = dd->pkt_size,
-		},
-	};
+	struct spi_transfer t[MAX_XFERS_PER_PKT];
+	int num_xfers;
 	int ret;
 	enum ack ack_req;
 	int ack;
 	int intn;
 	int num_tries_remaining = NUM_TRIES;
+	ktime_t start;
+
+	num_xfers = setup_pkt_xfers(dd, t, tx_pl, tx_pl_len);
 
 retry:
+	if (num_tries_remaining < NUM_TRIES)
+		dd->stats.retries++;
 
 	/* Set pinmux back to SPI configuration */
 	if (dd->ack_supported) {
@@ -383,7 +729,9 @@ retry:
 	}
 
 	/* Wait for RDY to be asserted */
+	start = ktime_get();
 	WAIT_WHILE((ret = muc_gpio_get_ready_n()), RDY_TIMEOUT_JIFFIES, dd);
+	stats_hist_add(dd->stats.rdy_wait, start);
 
 	/* Deassert WAKE if no longer requested OR on timeout OR removal */
 	if (!keep_wake || dd->ack_supported || ret != 0 || !dd->present)
@@ -403,7 +751,9 @@ retry:
 		return -ETIMEDOUT;
 	}
 
-	ret = spi_sync_transfer(spi, t, 1);
+	start = ktime_get();
+	ret = spi_sync_transfer(spi, t, num_xfers);
+	stats_hist_add(dd->stats.xfer_time, start);
 
 	if (ret) {
 		if (--num_tries_remaining > 0) {
@@ -429,9 +779,11 @@ retry:
 		dd->no_ack_sent++;
 
 	if (is_tx_pkt_valid(dd)) {
+		start = ktime_get();
 		WAIT_WHILE(!(ack = muc_gpio_get_ack()) &&
 			   (intn = muc_gpio_get_int_n()),
 			   ACK_TIMEOUT_JIFFIES, dd);
+		stats_hist_add(dd->stats.ack_wait, start);
 		if (!ack && intn) {
 			if (ack_req == ACK_ERROR) {
 				/*
@@ -443,6 +795,7 @@ retry:
 			}
 
 			dd->no_ack_rcvd++;
+			dd->tune_errs++;
 			if (--num_tries_remaining > 0) {
 				dev_err(&spi->dev, "Retry: No ACK received\n");
 				goto retry;
@@ -486,6 +839,8 @@ static enum ack parse_rx_pkt(struct muc_spi_data *dd)
 	if (le16_to_cpu(*rcvcrc_p) != calcrc) {
 		dev_err(&spi->dev, "CRC mismatch, received: 0x%x, "
 			"calculated: 0x%x\n", le16_to_cpu(*rcvcrc_p), calcrc);
+		dd->tune_errs++;
+		dd->stats.crc_errs++;
 
 		/*
 		 * If ACK'ing is supported, keep received data to allow for
@@ -506,6 +861,7 @@ static enum ack parse_rx_pkt(struct muc_spi_data *dd)
 
 			case HDR_BIT_DUMMY:
 				/* Received a dummy packet - nothing to do! */
+				dd->stats.rx_dummy++;
 				return ACK_NOT_NEEDED;
 
 			default:
@@ -514,9 +870,14 @@ static enum ack parse_rx_pkt(struct muc_spi_data *dd)
 		}
 	} else if (!(bitmask & HDR_BIT_VALID)) {
 		/* Received a dummy packet - nothing to do! */
+		dd->stats.rx_dummy++;
 		return ACK_NOT_NEEDED;
 	}
 
+	dd->tune_pkts++;
+	dd->stats.rx_pkts++;
+	dd->stats.rx_bytes += pl_size;
+
 	if (unlikely((bitmask & HDR_BIT_TYPE) == MSG_TYPE_DL))
 		handler = dl_recv;
 
@@ -565,6 +926,12 @@ static enum ack parse_rx_pkt(struct muc_spi_data *dd)
 	}
 
 skip_pkt1:
+	/* Datagrams that fit in one packet are handed up from the packet */
+	if (!dd->rx_datagram_ndx && !(bitmask & HDR_BIT_PKTS)) {
+		handler(dd->dld, &dd->rx_pkt[HDR_SIZE], pl_size);
+		return ACK_NEEDED;
+	}
+
 	if (unlikely(dd->rx_datagram_ndx >= MAX_DATAGRAM_SZ)) {
 		dev_err(&spi->dev, "Too many packets received!\n");
 		dd->rx_datagram_ndx = 0;
@@ -589,6 +956,7 @@ skip_pkt1:
 static irqreturn_t muc_spi_isr(int irq, void *data)
 {
 	struct muc_spi_data *dd = data;
+	size_t dummy_size = 0;
 	int ret = 0;
 
 	/* Any interrupt while the MuC is not present would be spurious */
@@ -598,16 +966,20 @@ static irqreturn_t muc_spi_isr(int irq, void *data)
 	mutex_lock(&dd->mutex);
 	pm_stay_awake(&dd->spi->dev);
 
-	/* Populate the SPI dummy message */
-	set_tx_pkt_hdr(dd, HDR_BIT_DUMMY);
-	set_tx_pkt_crc(dd);
-
 	while (!muc_gpio_get_int_n() && dd->present) {
-		ret = muc_spi_transfer(dd, (dd->pkts_remaining > 1));
+		/* Populate the SPI dummy message, again if the size changed */
+		if (dummy_size != dd->pkt_size) {
+			set_tx_pkt_hdr(dd, HDR_BIT_DUMMY);
+			set_tx_pkt_crc(dd);
+			dummy_size = dd->pkt_size;
+		}
+
+		ret = muc_spi_transfer(dd, (dd->pkts_remaining > 1), NULL, 0);
 		if (ret) {
 			dev_err(&dd->spi->dev, "isr spi transfer failed\n");
 			break;
 		}
+		dd->stats.tx_dummy++;
 	}
 
 	pm_relax(&dd->spi->dev);
@@ -679,8 +1051,10 @@ static int muc_attach(struct notifier_block *nb,
 
 			flush_work(&dd->attach_work);
 			if (dd->attached) {
-				mods_dl_dev_detached(dd->dld);
 				dd->attached = false;
+				mods_dl_dev_detached(dd->dld);
+				/* after detach, attach_done() may have armed it */
+				cancel_delayed_work_sync(&dd->tune_work);
 			}
 
 			if (dd->ack_supported)
@@ -699,6 +1073,7 @@ static int muc_attach(struct notifier_block *nb,
 			dd->no_ack_sent = 0;
 			dd->no_ack_rcvd = 0;
 			dd->no_ack_abort = 0;
+			tune_reset(dd);
 		}
 	}
 	return NOTIFY_OK;
@@ -716,20 +1091,46 @@ static int __muc_spi_message_send(struct muc_spi_data *dd, __u8 msg_type,
 				  uint8_t *buf, size_t len)
 {
 	int remaining = len;
-	size_t pl_size = PL_SIZE(dd->pkt_size);
+	size_t pl_size;
 	int packets;
 	int ret = 0;
 
 	if (!dd->present)
 		return -ENODEV;
 
+	if (len > MAX_DATAGRAM_SZ)
+		return -E2BIG;
+
+	/* Packet size may be changed by link tuning, so read it locked */
+	mutex_lock(&dd->mutex);
+
+	/*
+	 * Hold datagrams back while a packet size change is outstanding, so
+	 * none is split at a size the MuC is about to stop using. The bus
+	 * config request itself is a DL message and is not held.
+	 */
+	while (msg_type == MSG_TYPE_NW && dd->pkt_size_pending) {
+		mutex_unlock(&dd->mutex);
+		if (!wait_event_timeout(dd->pkt_size_wq,
+					!dd->pkt_size_pending,
+					RESIZE_TIMEOUT_JIFFIES)) {
+			dev_warn(&dd->spi->dev,
+				 "Packet size change timed out\n");
+			dd->pkt_size_pending = false;
+		}
+		mutex_lock(&dd->mutex);
+	}
+
+	pl_size = PL_SIZE(dd->pkt_size);
+
 	/* Calculate how many packets are required to send whole datagram */
 	packets = (remaining + pl_size - 1) / pl_size;
 
-	if ((len > MAX_DATAGRAM_SZ) || (packets > MAX_PKTS_PER_DG))
+	if (packets > MAX_PKTS_PER_DG) {
+		mutex_unlock(&dd->mutex);
 		return -E2BIG;
+	}
 
-	mutex_lock(&dd->mutex);
 	pm_stay_awake(&dd->spi->dev);
 
 	while ((remaining > 0) && (packets > 0)) {
@@ -748,17 +1149,30 @@ static int __muc_spi_message_send(struct muc_spi_data *dd, __u8 msg_type,
 
 		/* Populate the SPI message */
 		set_tx_pkt_hdr(dd, bitmask);
-		memcpy((dd->tx_pkt + HDR_SIZE), buf, this_pl);
-		set_tx_pkt_crc(dd);
-
-		ret = muc_spi_transfer(dd, (packets > 0));
+		if (can_tx_in_place(buf, this_pl)) {
+			set_tx_pkt_crc_split(dd, buf, this_pl);
+			ret = muc_spi_transfer(dd, (packets > 0), buf, this_pl);
+		} else {
+			memcpy((dd->tx_pkt + HDR_SIZE), buf, this_pl);
+			set_tx_pkt_crc(dd);
+			ret = muc_spi_transfer(dd, (packets > 0), NULL, 0);
+		}
 		if (ret)
 			break;
 
+		dd->tune_pkts++;
+		dd->stats.tx_pkts++;
+		dd->stats.tx_bytes += this_pl;
+
 		remaining -= this_pl;
 		buf += this_pl;
 	}
 
+	if (!ret && msg_type == MSG_TYPE_NW) {
+		dd->tune_tx_dgs++;
+		dd->tune_tx_bytes += len;
+	}
+
 	pm_relax(&dd->spi->dev);
 	mutex_unlock(&dd->mutex);
 
@@ -776,24 +1190,80 @@ static int muc_spi_message_send(struct mods_dl_device *dld,
 
 static struct mods_dl_driver muc_spi_dl_driver = {
 	.message_send		= muc_spi_message_send,
+	.attach_done		= muc_spi_attach_done,
 };
 
-#define STATS_BUF_SZ 100
-static ssize_t muc_spi_stats_read(struct file *f, char __user *buf,
-				size_t count, loff_t *ppos)
+static void muc_spi_stats_show_hist(struct seq_file *s, const char *name,
+				    const uint32_t *hist)
+{
+	int i;
+
+	seq_printf(s, "%s (us):\n", name);
+	for (i = 0; i < STATS_HIST_BUCKETS; i++) {
+		if (!hist[i])
+			continue;
+
+		if (!i)
+			seq_printf(s, "  %8s < %-6u %u\n", "", 1, hist[i]);
+		else if (i == STATS_HIST_BUCKETS - 1)
+			seq_printf(s, "  %8u+ %-7s %u\n", 1 << (i - 1), "",
+				   hist[i]);
+		else
+			seq_printf(s, "  %8u - %-6u %u\n", 1 << (i - 1),
+				   1 << i, hist[i]);
+	}
+}
+
+static int muc_spi_stats_show(struct seq_file *s, void *unused)
+{
+	struct muc_spi_data *dd = s->private;
+	struct muc_spi_stats *st = &dd->stats;
+
+	seq_printf(s, "No ACK sent:  %u\nNo ACK rcvd:  %u\nNo ACK abort: %u\n",
+		   dd->no_ack_sent, dd->no_ack_rcvd, dd->no_ack_abort);
+	seq_printf(s, "Bus speed:    %u Hz\nPacket size:  %zu\n",
+		   dd->spi->max_speed_hz, dd->pkt_size);
+	seq_printf(s, "TX bytes:     %llu\nTX packets:   %u\nTX dummy:     %u\n",
+		   st->tx_bytes, st->tx_pkts, st->tx_dummy);
+	seq_printf(s, "RX bytes:     %llu\nRX packets:   %u\nRX dummy:     %u\n",
+		   st->rx_bytes, st->rx_pkts, st->rx_dummy);
+	seq_printf(s, "CRC errors:   %u\nRetries:      %u\n",
+		   st->crc_errs, st->retries);
+
+	muc_spi_stats_show_hist(s, "RDY wait", st->rdy_wait);
+	muc_spi_stats_show_hist(s, "ACK wait", st->ack_wait);
+	muc_spi_stats_show_hist(s, "Transfer", st->xfer_time);
+
+	return 0;
+}
+
+static int muc_spi_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, muc_spi_stats_show, inode->i_private);
+}
+
+/* Any write resets the statistics */
+static ssize_t muc_spi_stats_write(struct file *f, const char __user *buf,
+				   size_t count, loff_t *ppos)
 {
 	struct muc_spi_data *dd = f->f_inode->i_private;
-	char tmp[STATS_BUF_SZ];
-	int size;
 
-	size = snprintf(tmp, STATS_BUF_SZ, "No ACK sent:  %u\nNo ACK rcvd:  %u"
-		"\nNo ACK abort: %u\n", dd->no_ack_sent, dd->no_ack_rcvd,
-		dd->no_ack_abort);
-	return simple_read_from_buffer(buf, count, ppos, tmp, size);
+	mutex_lock(&dd->mutex);
+	memset(&dd->stats, 0, sizeof(dd->stats));
+	dd->no_ack_sent = 0;
+	dd->no_ack_rcvd = 0;
+	dd->no_ack_abort = 0;
+	mutex_unlock(&dd->mutex);
+
+	return count;
 }
 
 static const struct file_operations muc_spi_stats_fops = {
-	.read	= muc_spi_stats_read,
+	.open		= muc_spi_stats_open,
+	.read		= seq_read,
+	.write		= muc_spi_stats_write,
+	.llseek		= seq_lseek,
+	.release	= single_release,
 };
 
 
@@ -884,6 +1354,9 @@ static int muc_spi_probe(struct spi_device *spi)
 	dd->attach_nb.notifier_call = muc_attach;
 	dd->ack_supported = muc_gpio_ack_is_supported();
 	INIT_WORK(&dd->attach_work, attach_worker);
+	INIT_DELAYED_WORK(&dd->tune_work, tune_worker);
+	init_waitqueue_head(&dd->pkt_size_wq);
+	tune_reset(dd);
 
 	ret = allocate_buffers(dd);
 	if (ret)
@@ -903,7 +1376,8 @@ static int muc_spi_probe(struct spi_device *spi)
 	if (ret)
 		dev_warn(&spi->dev, "Failed to wakeup_enable: %d\n", ret);
 
-	dd->stats_dentry = debugfs_create_file("muc_spi_stats", S_IRUGO,
+	dd->stats_dentry = debugfs_create_file("muc_spi_stats",
+				S_IRUGO | S_IWUSR,
 				mods_debugfs_get(), dd, &muc_spi_stats_fops);
 
 	register_muc_attach_notifier(&dd->attach_nb);
@@ -932,8 +1406,10 @@ static int muc_spi_remove(struct spi_device *spi)
 
 	flush_work(&dd->attach_work);
 	if (dd->attached) {
-		mods_dl_dev_detached(dd->dld);
 		dd->attached = false;
+		mods_dl_dev_detached(dd->dld);
+		/* after detach, attach_done() may have armed it */
+		cancel_delayed_work_sync(&dd->tune_work);
 	}
 
 	/*
@@ -15,6 +15,9 @@
 
 #include <linux/delay.h>
 #include <linux/err.h>
+#include <linux/hashtable.h>
+#include <linux/ktime.h>
+#include <linux/mempool.h>
 #include <linux/module.h>
 #include <linux/of.h>
 #include <linux/platform_device.h>
@@ -36,12 +39,27 @@ enum muc_svc_recover {
 	MUC_SVC_RECOVERY_SOFT,
 };
 
+/* Outstanding operations are hashed by their message ID */
+#define SVC_OPS_HASH_BITS 5
+
+struct svc_op_stats {
+	u64 lookups;
+	u64 misses;
+	u64 completed;
+	u64 timeouts;
+	u64 latency_total_us;
+	u64 latency_max_us;
+};
+
 struct muc_svc_data {
 	struct mods_dl_device *dld;
 	atomic_t msg_num;
-	struct list_head operations;
+	spinlock_t ops_lock;
+	DECLARE_HASHTABLE(operations, SVC_OPS_HASH_BITS);
+	struct svc_op_stats op_stats;
 	struct platform_device *pdev;
 	struct workqueue_struct *wq;
+	struct workqueue_struct *attach_wq;
 	struct kset *intf_kset;
 
 	struct list_head ext_intf;
@@ -58,6 +76,7 @@ struct muc_svc_data {
 	enum muc_svc_recover recovery_level;
 
 	bool mod_attached;
+	ktime_t attach_time;
 
 	u8 mod_root_ver;
 	u8 def_root_ver;
@@ -67,7 +86,37 @@ struct muc_svc_data *svc_dd;
 
 static DEFINE_MUTEX(slave_lock);
 static DEFINE_MUTEX(svc_list_lock);
-static DEFINE_SPINLOCK(svc_ops_lock);
+/* Serializes the failure accounting of concurrently attaching interfaces */
+static DEFINE_MUTEX(recovery_lock);
+
+/* Manifests of recently attached mods, most recently used first */
+#define MANIFEST_CACHE_MAX 8
+
+struct manifest_cache_entry {
+	struct list_head list;
+	u32 vid;
+	u32 pid;
+	u64 uid_low;
+	u64 uid_high;
+	u32 fw_version;
+	u16 size;
+	char data[0];
+};
+
+static LIST_HEAD(manifest_cache);
+static DEFINE_MUTEX(manifest_cache_lock);
+static unsigned int manifest_cache_count;
+static unsigned long manifest_cache_hits;
+static unsigned long manifest_cache_misses;
+
+/*
+ * Off by default: a mod can change its manifest without bumping its firmware
+ * version, and the protocol offers nothing cheaper than the manifest itself
+ * to compare, so a hit may be stale.  Only for setups with known mods.
+ */
+static bool manifest_cache_enable;
+module_param_named(manifest_cache, manifest_cache_enable, bool, 0644);
+MODULE_PARM_DESC(manifest_cache, "Reuse manifests of known mods on attach");
 
 /* Define the SVCs reserved area of CPORTS to create the vendor
  * connections to each interface
@@ -116,6 +165,12 @@ static inline void muc_svc_send_uevent(const char *event)
 	muc_svc_send_kobj_uevent(&svc_dd->pdev->dev.kobj, event);
 }
 
+static inline void
+muc_svc_trace(struct mods_dl_device *mods_dev, enum mods_attach_phase phase)
+{
+	mods_dev->attach_trace[phase] = ktime_get();
+}
+
 static void _do_muc_recovery_level(void)
 {
 	switch (svc_dd->recovery_level) {
@@ -152,6 +207,8 @@ static void muc_svc_recovery(void)
 	}
 	mutex_unlock(&svc_list_lock);
 
+	mutex_lock(&recovery_lock);
+
 	/* If this is first failure event, save the timestamp */
 	if (!svc_dd->fail_count)
 		svc_dd->first_fail = jiffies;
@@ -180,6 +237,8 @@ static void muc_svc_recovery(void)
 		muc_svc_send_uevent("MOD_ERROR=RECOVERY_ATTEMPT");
 		_do_muc_recovery_level();
 	}
+
+	mutex_unlock(&recovery_lock);
 }
 
 static void muc_svc_wdog(struct work_struct *work)
@@ -223,11 +282,13 @@ static void muc_svc_clear_wdog(struct mods_dl_device *mods_dev)
 {
 	cancel_delayed_work_sync(&svc_dd->wdog_work);
 
-	if (!svc_dd->fail_count)
-		return;
-
-	send_event_to_userspace("MOD_EVENT=RECOVERY_SUCCESS", mods_dev);
-	svc_dd->fail_count = 0;
+	mutex_lock(&recovery_lock);
+	if (svc_dd->fail_count) {
+		send_event_to_userspace("MOD_EVENT=RECOVERY_SUCCESS",
+					mods_dev);
+		svc_dd->fail_count = 0;
+	}
+	mutex_unlock(&recovery_lock);
 }
 
 #define MUC_SVC_WATCHDOG_ATTACH_TIMEOUT (5 * HZ) /* 5s */
@@ -235,6 +296,7 @@ static int
 muc_svc_attach(struct notifier_block *nb, unsigned long state, void *unused)
 {
 	if (state) {
+		svc_dd->attach_time = ktime_get();
 		queue_delayed_work(svc_dd->wdog_wq, &svc_dd->wdog_work,
 				MUC_SVC_WATCHDOG_ATTACH_TIMEOUT);
 		muc_svc_send_uevent("MOD_EVENT=ATTACHED");
@@ -444,6 +506,34 @@ static ssize_t vendor_updates_show(struct mods_dl_device *dev, char *buf)
 	return scnprintf(buf, PAGE_SIZE, "%s", supported);
 }
 
+static ssize_t attach_trace_show(struct mods_dl_device *dev, char *buf)
+{
+	static const char * const names[MODS_ATTACH_PHASES] = {
+		[MODS_ATTACH_DETECT]		= "detect",
+		[MODS_ATTACH_DL_READY]		= "dl_ready",
+		[MODS_ATTACH_MB_VERSION]	= "mb_version",
+		[MODS_ATTACH_IDS]		= "ids",
+		[MODS_ATTACH_MANIFEST]		= "manifest",
+		[MODS_ATTACH_HOTPLUG]		= "hotplug",
+		[MODS_ATTACH_CONNECTED]		= "connected",
+	};
+	ktime_t start = dev->attach_trace[MODS_ATTACH_DETECT];
+	ssize_t count = 0;
+	int i;
+
+	/* Times are in microseconds from the attach detection */
+	for (i = 0; i < MODS_ATTACH_PHASES; i++) {
+		if (!ktime_to_ns(dev->attach_trace[i]))
+			continue;
+
+		count += scnprintf(buf + count, PAGE_SIZE - count, "%s: %lld\n",
+				names[i],
+				ktime_us_delta(dev->attach_trace[i], start));
+	}
+
+	return count;
+}
+
 static ssize_t
 current_rsv_ack_store(struct mods_dl_device *mods_dev,
 		const char *buf, size_t count)
@@ -488,6 +578,7 @@ static MUC_SVC_ATTR(capability_reason, 0444, capability_reason_show, NULL);
 static MUC_SVC_ATTR(capability_vendor, 0444, capability_vendor_show, NULL);
 static MUC_SVC_ATTR(current_rsv_ack, 0444, NULL, current_rsv_ack_store);
 static MUC_SVC_ATTR(vendor_updates, 0444, vendor_updates_show, NULL);
+static MUC_SVC_ATTR(attach_trace, 0444, attach_trace_show, NULL);
 
 #define to_muc_svc_attr(a) \
 	container_of(a, struct muc_svc_attribute, attr)
@@ -539,6 +630,7 @@ static struct attribute *muc_svc_default_attrs[] = {
 	&muc_svc_attr_capability_vendor.attr,
 	&muc_svc_attr_current_rsv_ack.attr,
 	&muc_svc_attr_vendor_updates.attr,
+	&muc_svc_attr_attach_trace.attr,
 	NULL,
 };
 
@@ -661,50 +753,83 @@ static u8 gb_operation_errno_map(int errno)
 	}
 }
 
+/* SVC messages are allocated with headroom for the muc_msg_hdr, so they
+ * can be handed to the network layer without another copy. Messages that
+ * fit in a pool element are taken from a reserved pool so the common
+ * request/response round trip never waits on the allocator.
+ */
+#define SVC_MSG_POOL_PAYLOAD 256
+#define SVC_MSG_POOL_MIN 16
+#define SVC_OP_POOL_MIN 8
+
+struct svc_msg_env {
+	struct gb_message msg;
+	bool pooled;
+	struct muc_msg mm;
+};
+
+#define SVC_MSG_POOL_SIZE (sizeof(struct svc_msg_env) + \
+	sizeof(struct gb_operation_msg_hdr) + SVC_MSG_POOL_PAYLOAD)
+
+static struct kmem_cache *svc_msg_cache;
+static struct kmem_cache *svc_op_cache;
+static mempool_t *svc_msg_pool;
+static mempool_t *svc_op_pool;
+
 static struct gb_message *svc_gb_msg_alloc(u8 type, size_t payload_size)
 {
-	struct gb_message *msg;
+	struct svc_msg_env *env;
 	struct gb_operation_msg_hdr *hdr;
 	size_t message_size = payload_size + sizeof(*hdr);
+	size_t env_size = sizeof(*env) + message_size;
+	bool pooled = env_size <= SVC_MSG_POOL_SIZE;
 
-	msg = kzalloc(sizeof(*msg), GFP_KERNEL);
-	if (!msg)
+	if (pooled)
+		env = mempool_alloc(svc_msg_pool, GFP_KERNEL);
+	else
+		env = kmalloc(env_size, GFP_KERNEL);
+	if (!env)
 		return NULL;
 
-	msg->buffer = kzalloc(message_size, GFP_KERNEL);
-	if (!msg->buffer) {
-		kfree(msg);
-		return NULL;
-	}
+	memset(env, 0, env_size);
+	env->pooled = pooled;
 
-	hdr = msg->buffer;
+	hdr = (struct gb_operation_msg_hdr *)env->mm.gb_msg;
 	hdr->size = cpu_to_le16(message_size);
 	hdr->operation_id = 0;
 	hdr->type = type;
 	hdr->result = 0;
 
-	msg->header = hdr;
-	msg->payload = payload_size ? hdr + 1 : NULL;
-	msg->payload_size = payload_size;
+	env->msg.buffer = hdr;
+	env->msg.header = hdr;
+	env->msg.payload = payload_size ? hdr + 1 : NULL;
+	env->msg.payload_size = payload_size;
 
-	return msg;
+	return &env->msg;
 }
 
 static void svc_gb_msg_free(struct gb_message *msg)
 {
+	struct svc_msg_env *env;
+
 	if (!msg)
 		return;
-	kfree(msg->buffer);
-	kfree(msg);
+
+	env = container_of(msg, struct svc_msg_env, msg);
+	if (env->pooled)
+		mempool_free(env, svc_msg_pool);
+	else
+		kfree(env);
 }
 
 struct svc_op {
-	struct list_head entry;
+	struct hlist_node entry;
 	struct completion completion;
 	struct gb_message *request;
 	struct gb_message *response;
 	struct kref kref;
 	u16 msg_id;
+	ktime_t sent;
 };
 
 static inline struct muc_svc_data *dld_get_dd(struct mods_dl_device *dld)
@@ -721,27 +846,19 @@ static inline struct svc_op *svc_alloc_op(void)
 {
 	struct svc_op *op;
 
-	op = kzalloc(sizeof(*op), GFP_KERNEL);
+	op = mempool_alloc(svc_op_pool, GFP_KERNEL);
 	if (!op)
 		return op;
 
+	memset(op, 0, sizeof(*op));
 	kref_init(&op->kref);
 
 	return op;
 }
 
-static inline void svc_op_get_locked(struct svc_op *op)
-{
-	kref_get(&op->kref);
-}
-
 static inline void svc_op_get(struct svc_op *op)
 {
-	unsigned long flags;
-
-	spin_lock_irqsave(&svc_ops_lock, flags);
-	svc_op_get_locked(op);
-	spin_unlock_irqrestore(&svc_ops_lock, flags);
+	kref_get(&op->kref);
 }
 
 static void svc_op_kref_release(struct kref *kref)
@@ -751,60 +868,77 @@ static void svc_op_kref_release(struct kref *kref)
 	op = container_of(kref, struct svc_op, kref);
 	svc_gb_msg_free(op->request);
 	svc_gb_msg_free(op->response);
-	kfree(op);
+	mempool_free(op, svc_op_pool);
 }
 
 static inline void svc_op_put(struct svc_op *op)
+{
+	kref_put(&op->kref, svc_op_kref_release);
+}
+
+static void svc_add_op(struct muc_svc_data *dd, struct svc_op *op)
 {
 	unsigned long flags;
 
-	spin_lock_irqsave(&svc_ops_lock, flags);
-	kref_put(&op->kref, svc_op_kref_release);
-	spin_unlock_irqrestore(&svc_ops_lock, flags);
+	spin_lock_irqsave(&dd->ops_lock, flags);
+	hash_add(dd->operations, &op->entry, op->msg_id);
+	spin_unlock_irqrestore(&dd->ops_lock, flags);
 }
 
+static void svc_del_op(struct muc_svc_data *dd, struct svc_op *op)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&dd->ops_lock, flags);
+	hash_del(&op->entry);
+	spin_unlock_irqrestore(&dd->ops_lock, flags);
+}
+
+/* An operation holds its own reference while hashed, so the reference
+ * taken here can never race with the final put.
+ */
 static struct svc_op *svc_find_op(struct muc_svc_data *dd, uint16_t id)
 {
-	struct svc_op *e, *tmp;
+	struct svc_op *e;
 	unsigned long flags;
+	s64 latency;
 
-	spin_lock_irqsave(&svc_ops_lock, flags);
-	list_for_each_entry_safe(e, tmp, &dd->operations, entry)
+	spin_lock_irqsave(&dd->ops_lock, flags);
+	dd->op_stats.lookups++;
+	hash_for_each_possible(dd->operations, e, entry, id)
 		if (e->msg_id == id) {
-			svc_op_get_locked(e);
+			svc_op_get(e);
 			goto found;
 		}
-	e = NULL;
+	dd->op_stats.misses++;
+	spin_unlock_irqrestore(&dd->ops_lock, flags);
+
+	return NULL;
+
 found:
-	spin_unlock_irqrestore(&svc_ops_lock, flags);
+	latency = ktime_us_delta(ktime_get(), e->sent);
+	dd->op_stats.completed++;
+	dd->op_stats.latency_total_us += latency;
+	if (latency > dd->op_stats.latency_max_us)
+		dd->op_stats.latency_max_us = latency;
+	spin_unlock_irqrestore(&dd->ops_lock, flags);
 
 	return e;
 }
 
-/* Route a gb_message to the mods_nw layer, adding the necessary
- * envelope that it understands.
+/* Route a gb_message to the mods_nw layer, filling in the envelope that
+ * it understands in the headroom reserved by svc_gb_msg_alloc().
  */
 static int
 svc_route_msg(struct mods_dl_device *dld, uint16_t cport,
 		struct gb_message *msg)
 {
-	struct muc_msg *m;
-	size_t muc_payload = get_gb_msg_size(msg);
-	size_t msg_size = muc_payload + sizeof(m->hdr);
-	int ret;
+	struct svc_msg_env *env = container_of(msg, struct svc_msg_env, msg);
 
-	m = kmalloc(msg_size, GFP_KERNEL);
-	if (!m)
-		return -ENOMEM;
-
-	memcpy(m->gb_msg, msg->buffer, muc_payload);
-	m->hdr.cport = cpu_to_le16(cport);
-
-	ret = mods_nw_switch(dld, (uint8_t *)m, msg_size);
+	env->mm.hdr.cport = cpu_to_le16(cport);
 
-	kfree(m);
-
-	return ret;
+	return mods_nw_switch(dld, (uint8_t *)&env->mm,
+			get_gb_msg_size(msg) + sizeof(env->mm.hdr));
 }
 
 static inline size_t get_gb_payload_size(size_t message_size)
@@ -812,6 +946,18 @@ static inline size_t get_gb_payload_size(size_t message_size)
 	return message_size - sizeof(struct gb_operation_msg_hdr);
 }
 
+/* Describe a received message in place, without copying it. The result is
+ * only valid while the receive buffer is, so it must not outlive the call.
+ */
+static void svc_gb_msg_wrap(struct gb_message *msg, uint8_t *data,
+		size_t msg_size)
+{
+	msg->buffer = data;
+	msg->header = (struct gb_operation_msg_hdr *)data;
+	msg->payload_size = get_gb_payload_size(msg_size);
+	msg->payload = msg->payload_size ? msg->header + 1 : NULL;
+}
+
 static int svc_set_intf_id(struct mods_dl_device *dld, struct gb_message *req)
 {
 	struct muc_svc_data *dd = dld_get_dd(dld);
@@ -920,21 +1066,35 @@ struct svc_gb_dme_entry {
 	u16 attr;
 	u16 selector;
 	u32 default_value;
+	bool immutable;		/* fixed once the interface is attached */
 	int (*dme_get)(struct mods_dl_device *dld, u8 intf_id,
 			u16 attr, u16 selector, u32 *value);
 	int (*dme_set)(struct mods_dl_device *dld, u8 intf_id,
 			u16 attr, u16 selector, u32 value);
 };
 
-static struct svc_gb_dme_entry dme_entries[] = {
-	{
+/* Indexed by enum mods_dme_attr, which is also the layout of the
+ * per-interface values in mods_dl_device.dme_values.
+ */
+static struct svc_gb_dme_entry dme_entries[MODS_DME_ATTRS] = {
+	[MODS_DME_TST_SRC_INCREMENT] = {
 		.attr = DME_ATTR_T_TST_SRC_INCREMENT,
 		.selector = DME_ATTR_SELECTOR_INDEX,
 		.default_value = 0xB007ED,
 	},
+	[MODS_DME_MANUFACTURERID] = {
+		.attr = DME_ATTR_DDBL1_MANUFACTURERID,
+		.selector = DME_ATTR_SELECTOR_INDEX,
+		.immutable = true,
+	},
+	[MODS_DME_PRODUCTID] = {
+		.attr = DME_ATTR_DDBL1_PRODUCTID,
+		.selector = DME_ATTR_SELECTOR_INDEX,
+		.immutable = true,
+	},
 };
 
-static struct svc_gb_dme_entry *svc_gb_get_dme_entry(u16 attr, u16 selector)
+static int svc_gb_get_dme_index(u16 attr, u16 selector)
 {
 	int i;
 
@@ -943,10 +1103,27 @@ static struct svc_gb_dme_entry *svc_gb_get_dme_entry(u16 attr, u16 selector)
 			continue;
 		if (dme_entries[i].selector != selector)
 			continue;
-		return &dme_entries[i];
+		return i;
 	}
 
-	return NULL;
+	return -ENOENT;
+}
+
+/* Fill the DME attributes of an interface once, from what was learned
+ * during attach, so the AP's reads are answered without a round trip.
+ */
+static void muc_svc_dme_cache_init(struct mods_dl_device *mods_dev,
+			struct gb_svc_intf_hotplug_request *hotplug)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(dme_entries); i++)
+		mods_dev->dme_values[i] = dme_entries[i].default_value;
+
+	mods_dev->dme_values[MODS_DME_MANUFACTURERID] =
+		le32_to_cpu(hotplug->data.unipro_mfg_id);
+	mods_dev->dme_values[MODS_DME_PRODUCTID] =
+		le32_to_cpu(hotplug->data.unipro_prod_id);
 }
 
 static int
@@ -956,31 +1133,48 @@ svc_gb_dme_get(struct mods_dl_device *dld, struct gb_message *req_msg,
 	struct gb_svc_dme_peer_get_request *req;
 	struct gb_svc_dme_peer_get_response resp;
 	struct svc_gb_dme_entry *entry;
+	struct mods_dl_device *mods_dev;
 	int ret;
+	int idx;
 	u16 attr;
 	u16 selector;
+	u32 value;
 
 	req = (struct gb_svc_dme_peer_get_request *)req_msg->payload;
 	attr = le16_to_cpu(req->attr);
 	selector = le16_to_cpu(req->selector);
 
-	entry = svc_gb_get_dme_entry(attr, selector);
-	if (!entry) {
-		resp.result_code = GB_OP_NONEXISTENT;
+	idx = svc_gb_get_dme_index(attr, selector);
+	if (idx < 0) {
+		resp.result_code = cpu_to_le16(GB_OP_NONEXISTENT);
+		resp.attr_value = 0;
 		goto send_response;
 	}
+	entry = &dme_entries[idx];
 
-	/* If there is a specific handler, use it, otherwise lets just
-	 * use the default value we always want to return.
+	/* Immutable attributes come from the interface's cache, and do not
+	 * exist for an interface that is not registered. Otherwise if there
+	 * is a specific handler, use it, or just use the default value we
+	 * always want to return.
 	 */
-	if (entry->dme_get) {
+	if (entry->immutable) {
+		mods_dev = mods_nw_get_dl_device(req->intf_id);
+		if (!mods_dev) {
+			resp.result_code = cpu_to_le16(GB_OP_NONEXISTENT);
+			resp.attr_value = 0;
+			goto send_response;
+		}
+		resp.result_code = cpu_to_le16(GB_OP_SUCCESS);
+		value = mods_dev->dme_values[idx];
+	} else if (entry->dme_get) {
 		ret = entry->dme_get(dld, req->intf_id, attr,
-					selector, &resp.attr_value);
-		resp.result_code = gb_operation_errno_map(ret);
+					selector, &value);
+		resp.result_code = cpu_to_le16(gb_operation_errno_map(ret));
 	} else {
-		resp.result_code = GB_OP_SUCCESS;
-		resp.attr_value = entry->default_value;
+		resp.result_code = cpu_to_le16(GB_OP_SUCCESS);
+		value = entry->default_value;
 	}
+	resp.attr_value = cpu_to_le32(value);
 
 send_response:
 	ret = svc_gb_send_response(dld, cport, req_msg, sizeof(resp),
@@ -1001,27 +1195,35 @@ svc_gb_dme_set(struct mods_dl_device *dld, struct gb_message *req_msg,
 	struct gb_svc_dme_peer_set_response resp;
 	struct svc_gb_dme_entry *entry;
 	int ret;
+	int idx;
 	u16 attr;
 	u16 selector;
+	u32 value;
 
 	req = (struct gb_svc_dme_peer_set_request *)req_msg->payload;
 	attr = le16_to_cpu(req->attr);
 	selector = le16_to_cpu(req->selector);
+	value = le32_to_cpu(req->value);
+
+	idx = svc_gb_get_dme_index(attr, selector);
+	if (idx < 0) {
+		resp.result_code = cpu_to_le16(GB_OP_NONEXISTENT);
+		goto send_response;
+	}
+	entry = &dme_entries[idx];
 
-	entry = svc_gb_get_dme_entry(attr, selector);
-	if (!entry) {
-		resp.result_code = GB_OP_NONEXISTENT;
+	if (entry->immutable) {
+		resp.result_code = cpu_to_le16(GB_OP_INVALID);
 		goto send_response;
 	}
 
 	/* If there is a specific handler, use it, otherwise done
 	 */
 	if (entry->dme_set) {
-		ret = entry->dme_set(dld, req->intf_id, attr, selector,
-					le32_to_cpu(req->value));
-		resp.result_code = gb_operation_errno_map(ret);
+		ret = entry->dme_set(dld, req->intf_id, attr, selector, value);
+		resp.result_code = cpu_to_le16(gb_operation_errno_map(ret));
 	} else {
-		resp.result_code = GB_OP_SUCCESS;
+		resp.result_code = cpu_to_le16(GB_OP_SUCCESS);
 	}
 
 send_response:
@@ -1040,17 +1242,13 @@ muc_svc_handle_ap_request(struct mods_dl_device *dld, uint8_t *data,
 			  size_t msg_size, uint16_t cport)
 {
 	struct muc_svc_data *dd = dld_get_dd(dld);
-	size_t payload_size = get_gb_payload_size(msg_size);
-	struct gb_message *req;
+	struct gb_message msg;
+	struct gb_message *req = &msg;
 	int ret = 0;
 	struct gb_operation_msg_hdr hdr;
 
 	memcpy(&hdr, data, sizeof(hdr));
-
-	req = svc_gb_msg_alloc(hdr.type, payload_size);
-	if (!req)
-		return -ENOMEM;
-	memcpy(req->header, data, msg_size);
+	svc_gb_msg_wrap(req, data, msg_size);
 
 	switch (hdr.type) {
 	case GB_SVC_TYPE_INTF_DEVICE_ID:
@@ -1071,15 +1269,15 @@ muc_svc_handle_ap_request(struct mods_dl_device *dld, uint8_t *data,
 		break;
 	case GB_SVC_TYPE_DME_PEER_GET:
 		ret = svc_gb_dme_get(dld, req, cport);
-		goto free_request;
+		return ret;
 	case GB_SVC_TYPE_DME_PEER_SET:
 		ret = svc_gb_dme_set(dld, req, cport);
-		goto free_request;
+		return ret;
 	default:
 		dev_err(&dd->pdev->dev, "Unsupported AP Request type: %d\n",
 					hdr.type);
 		ret = -EINVAL;
-		goto free_request;
+		return ret;
 	}
 
 	/* If hdr operation id is non-zero, it expects a response */
@@ -1090,14 +1288,10 @@ muc_svc_handle_ap_request(struct mods_dl_device *dld, uint8_t *data,
 			dev_err(&dd->pdev->dev,
 				"Failed to send AP response for type: %d\n",
 				hdr.type);
-			goto free_request;
+			return ret;
 		}
 	}
 
-free_request:
-	/* Done with the request and op */
-	svc_gb_msg_free(req);
-
 	return ret;
 }
 
@@ -1204,17 +1398,13 @@ muc_svc_handle_mods_request(struct mods_dl_device *dld, uint8_t *data,
 			  size_t msg_size, uint16_t cport)
 {
 	struct muc_svc_data *dd = dld_get_dd(dld);
-	size_t payload_size = get_gb_payload_size(msg_size);
-	struct gb_message *req;
+	struct gb_message msg;
+	struct gb_message *req = &msg;
 	int ret;
 	struct gb_operation_msg_hdr hdr;
 
 	memcpy(&hdr, data, sizeof(hdr));
-
-	req = svc_gb_msg_alloc(hdr.type, payload_size);
-	if (!req)
-		return -ENOMEM;
-	memcpy(req->header, data, msg_size);
+	svc_gb_msg_wrap(req, data, msg_size);
 
 	switch (hdr.type) {
 	case MB_CONTROL_TYPE_SLAVE_STATE:
@@ -1230,7 +1420,7 @@ muc_svc_handle_mods_request(struct mods_dl_device *dld, uint8_t *data,
 		dev_err(&dd->pdev->dev, "Unsupported Mods Request type: %d\n",
 					hdr.type);
 		ret = -EINVAL;
-		goto free_request;
+		return ret;
 	}
 
 	/* If hdr operation id is non-zero, it expects a response */
@@ -1241,14 +1431,10 @@ muc_svc_handle_mods_request(struct mods_dl_device *dld, uint8_t *data,
 			dev_err(&dd->pdev->dev,
 				"Failed to send mods response for type: %d\n",
 				hdr.type);
-			goto free_request;
+			return ret;
 		}
 	}
 
-free_request:
-	/* Done with the request and op */
-	svc_gb_msg_free(req);
-
 	return ret;
 }
 
@@ -1301,18 +1487,18 @@ svc_gb_msg_recv(struct mods_dl_device *dld, uint8_t *data,
 	return muc_svc_handle_ap_request(dld, data, msg_size, cport);
 }
 
-/* Send a message out the specified CPORT and wait for a response */
-static struct gb_message *
-_svc_gb_msg_send_sync(struct mods_dl_device *dld, uint8_t *data, uint8_t type,
-		size_t payload_size, uint16_t cport, bool response,
-		uint16_t timeout)
+/* Send a message out the specified CPORT. When a response is wanted the
+ * returned operation must be passed to svc_gb_msg_wait().
+ */
+static struct svc_op *
+svc_gb_msg_send_async(struct mods_dl_device *dld, uint8_t *data, uint8_t type,
+		size_t payload_size, uint16_t cport, bool response)
 {
 	struct muc_svc_data *dd = dld_get_dd(dld);
 	struct svc_op *op;
 	struct gb_message *msg;
 	int ret;
 	uint16_t cycle;
-	unsigned long flags;
 
 	op = svc_alloc_op();
 	if (!op)
@@ -1335,9 +1521,8 @@ _svc_gb_msg_send_sync(struct mods_dl_device *dld, uint8_t *data, uint8_t type,
 		init_completion(&op->completion);
 
 		msg->header->operation_id = cpu_to_le16(op->msg_id);
-		spin_lock_irqsave(&svc_ops_lock, flags);
-		list_add_tail(&op->entry, &dd->operations);
-		spin_unlock_irqrestore(&svc_ops_lock, flags);
+		op->sent = ktime_get();
+		svc_add_op(dd, op);
 	}
 
 	/* Send to NW Routing Layer */
@@ -1355,21 +1540,52 @@ _svc_gb_msg_send_sync(struct mods_dl_device *dld, uint8_t *data, uint8_t type,
 		return NULL;
 	}
 
+	return op;
+
+remove_op:
+	if (response)
+		svc_del_op(dd, op);
+
+gb_msg_alloc:
+	svc_op_put(op);
+
+	return ERR_PTR(ret);
+}
+
+/* Wait for the response to an operation sent by svc_gb_msg_send_async()
+ * and release the operation.
+ */
+static struct gb_message *
+svc_gb_msg_wait(struct mods_dl_device *dld, struct svc_op *op,
+		uint16_t timeout)
+{
+	struct muc_svc_data *dd = dld_get_dd(dld);
+	struct gb_message *msg;
+	u8 type = op->request->header->type;
+	int ret;
+
 	ret = wait_for_completion_interruptible_timeout(&op->completion,
 					msecs_to_jiffies(timeout));
 	if (ret <= 0) {
 		dev_err(&dd->pdev->dev,
 				"svc msg timeout -> ret: %d type: %d\n",
 				ret, type);
-		if (!ret)
+		if (!ret) {
+			unsigned long flags;
+
+			spin_lock_irqsave(&dd->ops_lock, flags);
+			dd->op_stats.timeouts++;
+			spin_unlock_irqrestore(&dd->ops_lock, flags);
 			ret = -ETIMEDOUT;
-		goto remove_op;
+		}
+		svc_del_op(dd, op);
+		svc_op_put(op);
+
+		return ERR_PTR(ret);
 	}
 
 	/* Remove and free the request */
-	spin_lock_irqsave(&svc_ops_lock, flags);
-	list_del(&op->entry);
-	spin_unlock_irqrestore(&svc_ops_lock, flags);
+	svc_del_op(dd, op);
 
 	msg = op->response;
 	if (msg->header->result) {
@@ -1384,17 +1600,29 @@ _svc_gb_msg_send_sync(struct mods_dl_device *dld, uint8_t *data, uint8_t type,
 	svc_op_put(op);
 
 	return msg;
+}
 
-remove_op:
-	spin_lock_irqsave(&svc_ops_lock, flags);
-	if (response)
-		list_del(&op->entry);
-	spin_unlock_irqrestore(&svc_ops_lock, flags);
-
-gb_msg_alloc:
+/* Give up on an operation sent by svc_gb_msg_send_async() */
+static void svc_gb_msg_cancel(struct mods_dl_device *dld, struct svc_op *op)
+{
+	svc_del_op(dld_get_dd(dld), op);
 	svc_op_put(op);
+}
 
-	return ERR_PTR(ret);
+/* Send a message out the specified CPORT and wait for a response */
+static struct gb_message *
+_svc_gb_msg_send_sync(struct mods_dl_device *dld, uint8_t *data, uint8_t type,
+		size_t payload_size, uint16_t cport, bool response,
+		uint16_t timeout)
+{
+	struct svc_op *op;
+
+	op = svc_gb_msg_send_async(dld, data, type, payload_size, cport,
+				response);
+	if (IS_ERR_OR_NULL(op))
+		return ERR_CAST(op);
+
+	return svc_gb_msg_wait(dld, op, timeout);
 }
 
 static inline struct gb_message *
@@ -1550,16 +1778,15 @@ static void muc_svc_broadcast_slave_notification(struct mods_dl_device *master)
 static int
 muc_svc_get_hotplug_data(struct mods_dl_device *dld,
 			struct gb_svc_intf_hotplug_request *hotplug,
-			struct mods_dl_device *mods_dev)
+			struct mods_dl_device *mods_dev, struct svc_op *op)
 {
 	struct mb_control_get_ids_response *ids;
 	struct muc_svc_data *dd = dld_get_dd(dld);
 	struct gb_message *msg;
 	int ret;
 
-	/* GET_IDs has no payload */
-	msg = svc_gb_msg_send_sync(dld, NULL, MB_CONTROL_TYPE_GET_IDS,
-				0, SVC_VENDOR_CTRL_CPORT(mods_dev->intf_id));
+	/* GET_IDs was sent with the other attach requests */
+	msg = svc_gb_msg_wait(dld, op, SVC_MSG_DEFAULT_TIMEOUT);
 	if (IS_ERR(msg)) {
 		dev_err(&dd->pdev->dev, "[%d] Failed to get GET_IDS\n",
 			mods_dev->intf_id);
@@ -1620,16 +1847,15 @@ free_gb_msg:
 }
 
 static int muc_svc_get_root_version(struct mods_dl_device *dld,
-					struct mods_dl_device *mods_dev)
+					struct mods_dl_device *mods_dev,
+					struct svc_op *op)
 {
 	struct mb_control_root_ver_response *ver;
 	struct muc_svc_data *dd = dld_get_dd(dld);
 	struct gb_message *msg;
 	int ret = 0;
 
-	/* GET_ROOT_VER has no payload */
-	msg = svc_gb_msg_send_sync(dld, NULL, MB_CONTROL_TYPE_GET_ROOT_VER,
-				0, SVC_VENDOR_CTRL_CPORT(mods_dev->intf_id));
+	msg = svc_gb_msg_wait(dld, op, SVC_MSG_DEFAULT_TIMEOUT);
 	if (IS_ERR(msg)) {
 		dev_warn(&dd->pdev->dev, "[%d] Failed to get GET_ROOT_VER\n",
 			mods_dev->intf_id);
@@ -1700,15 +1926,14 @@ static inline const char *muc_svc_pwrup_to_string(uint32_t reason)
 }
 
 static void muc_svc_get_pwrup_reason(struct mods_dl_device *dld,
-		struct mods_dl_device *mods_dev)
+		struct mods_dl_device *mods_dev, struct svc_op *op)
 {
 	struct mb_control_get_pwrup_reason_response *resp;
 	struct muc_svc_data *dd = dld_get_dd(dld);
 	struct gb_message *msg;
 	uint32_t mod_pwrup_reason;
 
-	msg = svc_gb_msg_send_sync(dld, NULL, MB_CONTROL_TYPE_GET_PWRUP_REASON,
-				0, SVC_VENDOR_CTRL_CPORT(mods_dev->intf_id));
+	msg = svc_gb_msg_wait(dld, op, SVC_MSG_DEFAULT_TIMEOUT);
 	if (IS_ERR(msg)) {
 		dev_warn(&dd->pdev->dev, "[%d] Failed to get PWRUP_REASON\n",
 			mods_dev->intf_id);
@@ -1753,34 +1978,35 @@ static void muc_svc_attach_work(struct work_struct *work)
 	}
 
 	hpw->dld->hotplug_sent = true;
+	muc_svc_trace(hpw->dld, MODS_ATTACH_HOTPLUG);
 	dev_info(&svc_dd->pdev->dev, "[%d] Successfully sent HOTPLUG\n",
 			hpw->hotplug.intf_id);
 
 	svc_gb_msg_free(msg);
 }
 
-static int muc_svc_control_version(struct mods_dl_device *mods_dev, u8 type,
-					u8 host_major, u8 host_minor,
-					uint16_t cport, u8 *major, u8 *minor)
+static struct svc_op *muc_svc_control_version_send(u8 type, u8 host_major,
+					u8 host_minor, uint16_t cport)
 {
-	struct gb_protocol_version_response *ver;
-	struct gb_message *msg;
+	struct gb_protocol_version_response ver;
 
-	ver = kmalloc(sizeof(*ver), GFP_KERNEL);
-	if (!ver)
-		return -ENOMEM;
+	ver.major = host_major;
+	ver.minor = host_minor;
 
-	ver->major = host_major;
-	ver->minor = host_minor;
+	return svc_gb_msg_send_async(svc_dd->dld, (uint8_t *)&ver, type,
+				sizeof(ver), cport, true);
+}
 
-	msg = svc_gb_msg_send_sync(svc_dd->dld, (uint8_t *)ver,
-				type, sizeof(*ver), cport);
-	if (IS_ERR(msg)) {
-		kfree(ver);
+static int muc_svc_control_version_recv(struct svc_op *op, uint16_t cport,
+					u8 *major, u8 *minor)
+{
+	struct gb_protocol_version_response *ver;
+	struct gb_message *msg;
+
+	msg = svc_gb_msg_wait(svc_dd->dld, op, SVC_MSG_DEFAULT_TIMEOUT);
+	if (IS_ERR(msg))
 		return PTR_ERR(msg);
-	}
 
-	kfree(ver);
 	ver = msg->payload;
 
 	dev_dbg(&svc_dd->pdev->dev, "[%d] CONTROL VERSION: %hhu.%hhu\n",
@@ -1794,6 +2020,19 @@ static int muc_svc_control_version(struct mods_dl_device *mods_dev, u8 type,
 	return 0;
 }
 
+static int muc_svc_control_version(struct mods_dl_device *mods_dev, u8 type,
+					u8 host_major, u8 host_minor,
+					uint16_t cport, u8 *major, u8 *minor)
+{
+	struct svc_op *op;
+
+	op = muc_svc_control_version_send(type, host_major, host_minor, cport);
+	if (IS_ERR(op))
+		return PTR_ERR(op);
+
+	return muc_svc_control_version_recv(op, cport, major, minor);
+}
+
 static int muc_svc_version_heartbeat(void)
 {
 	struct mods_dl_device *mods_dev;
@@ -1820,31 +2059,145 @@ static int muc_svc_version_heartbeat(void)
 	return ret;
 }
 
+static inline bool
+manifest_cache_match(struct manifest_cache_entry *e,
+		struct mods_dl_device *mods_dev,
+		struct gb_svc_intf_hotplug_request *hotplug)
+{
+	return e->vid == hotplug->data.ara_vend_id &&
+		e->pid == hotplug->data.ara_prod_id &&
+		e->uid_low == mods_dev->uid_low &&
+		e->uid_high == mods_dev->uid_high &&
+		e->fw_version == mods_dev->fw_version;
+}
+
+/* Mods that did not answer GET_IDS all look alike, never cache them */
+static inline bool manifest_cache_usable(struct mods_dl_device *mods_dev)
+{
+	return manifest_cache_enable &&
+		(mods_dev->uid_low || mods_dev->uid_high);
+}
+
+static void manifest_cache_flush(void)
+{
+	struct manifest_cache_entry *e;
+	struct manifest_cache_entry *tmp;
+
+	mutex_lock(&manifest_cache_lock);
+	list_for_each_entry_safe(e, tmp, &manifest_cache, list) {
+		list_del(&e->list);
+		kfree(e);
+	}
+	manifest_cache_count = 0;
+	mutex_unlock(&manifest_cache_lock);
+}
+
+/* Copy a cached manifest of the reported size into the device, if any */
+static bool
+manifest_cache_lookup(struct mods_dl_device *mods_dev,
+		struct gb_svc_intf_hotplug_request *hotplug)
+{
+	struct manifest_cache_entry *e;
+
+	if (!manifest_cache_usable(mods_dev))
+		return false;
+
+	mutex_lock(&manifest_cache_lock);
+	list_for_each_entry(e, &manifest_cache, list) {
+		if (!manifest_cache_match(e, mods_dev, hotplug))
+			continue;
+
+		if (e->size != mods_dev->manifest_size)
+			break;
+
+		memcpy(mods_dev->manifest, e->data, e->size);
+		list_move(&e->list, &manifest_cache);
+		manifest_cache_hits++;
+		mutex_unlock(&manifest_cache_lock);
+
+		return true;
+	}
+	manifest_cache_misses++;
+	mutex_unlock(&manifest_cache_lock);
+
+	return false;
+}
+
+static void
+manifest_cache_add(struct mods_dl_device *mods_dev,
+		struct gb_svc_intf_hotplug_request *hotplug)
+{
+	struct manifest_cache_entry *e;
+	struct manifest_cache_entry *tmp;
+	struct manifest_cache_entry *n;
+
+	if (!manifest_cache_enable) {
+		manifest_cache_flush();
+		return;
+	}
+
+	if (!manifest_cache_usable(mods_dev))
+		return;
+
+	e = kmalloc(sizeof(*e) + mods_dev->manifest_size, GFP_KERNEL);
+	if (!e)
+		return;
+
+	e->vid = hotplug->data.ara_vend_id;
+	e->pid = hotplug->data.ara_prod_id;
+	e->uid_low = mods_dev->uid_low;
+	e->uid_high = mods_dev->uid_high;
+	e->fw_version = mods_dev->fw_version;
+	e->size = mods_dev->manifest_size;
+	memcpy(e->data, mods_dev->manifest, e->size);
+
+	mutex_lock(&manifest_cache_lock);
+
+	/* Replace a stale entry for the same mod */
+	list_for_each_entry_safe(tmp, n, &manifest_cache, list) {
+		if (manifest_cache_match(tmp, mods_dev, hotplug)) {
+			list_del(&tmp->list);
+			kfree(tmp);
+			manifest_cache_count--;
+		}
+	}
+
+	list_add(&e->list, &manifest_cache);
+	if (++manifest_cache_count > MANIFEST_CACHE_MAX) {
+		tmp = list_last_entry(&manifest_cache,
+				      struct manifest_cache_entry, list);
+		list_del(&tmp->list);
+		kfree(tmp);
+		manifest_cache_count--;
+	}
+
+	mutex_unlock(&manifest_cache_lock);
+}
+
+/* Collect the CONTROL version and manifest size responses, which were sent
+ * with the other attach requests, then fetch the manifest.
+ */
 static int
-muc_svc_get_manifest(struct mods_dl_device *mods_dev, uint16_t out_cport)
+muc_svc_get_manifest(struct mods_dl_device *mods_dev, uint16_t out_cport,
+		struct gb_svc_intf_hotplug_request *hotplug,
+		struct svc_op *ver_op, struct svc_op *size_op)
 {
 	struct gb_control_get_manifest_size_response *size_resp;
 	struct device *dev = &svc_dd->pdev->dev;
 	struct gb_message *msg;
-	u8 type = GB_REQUEST_TYPE_PROTOCOL_VERSION;
 	int err;
 
-	err = muc_svc_control_version(mods_dev, type,
-					GB_CONTROL_VERSION_MAJOR,
-					GB_CONTROL_VERSION_MINOR,
-					out_cport,
+	err = muc_svc_control_version_recv(ver_op, out_cport,
 					&mods_dev->gb_ctrl_major,
 					&mods_dev->gb_ctrl_minor);
 	if (err) {
 		dev_err(dev, "[%d] Failed VERSION on CONTROL\n",
 			mods_dev->intf_id);
+		svc_gb_msg_cancel(svc_dd->dld, size_op);
 		return err;
 	}
 
-	/* GET_SIZE has no payload */
-	msg = svc_gb_msg_send_sync(svc_dd->dld, NULL,
-					GB_CONTROL_TYPE_GET_MANIFEST_SIZE,
-					0, out_cport);
+	msg = svc_gb_msg_wait(svc_dd->dld, size_op, SVC_MSG_DEFAULT_TIMEOUT);
 	if (IS_ERR(msg)) {
 		dev_err(dev, "[%d] Failed to get MANIFEST_SIZE\n",
 			mods_dev->intf_id);
@@ -1862,6 +2215,13 @@ muc_svc_get_manifest(struct mods_dl_device *mods_dev, uint16_t out_cport)
 		goto clear_size;
 	}
 
+	/* A known mod reporting the same size skips the manifest transfer */
+	if (manifest_cache_lookup(mods_dev, hotplug)) {
+		dev_info(dev, "[%d] Using cached MANIFEST\n",
+			mods_dev->intf_id);
+		goto create_sysfs;
+	}
+
 	/* GET_MANIFEST has no payload */
 	msg = svc_gb_msg_send_sync(svc_dd->dld, NULL,
 					GB_CONTROL_TYPE_GET_MANIFEST,
@@ -1877,6 +2237,9 @@ muc_svc_get_manifest(struct mods_dl_device *mods_dev, uint16_t out_cport)
 
 	svc_gb_msg_free(msg);
 
+	manifest_cache_add(mods_dev, hotplug);
+
+create_sysfs:
 	/* Update with the latest size and notify userspace */
 	mods_dev->manifest_attr.size = mods_dev->manifest_size;
 
@@ -1911,11 +2274,24 @@ static int muc_svc_send_rtc_sync(struct mods_dl_device *mods_dev)
 	return ret;
 }
 
+/* Attach requests sent together once the vendor control version is known */
+enum {
+	ATTACH_OP_IDS,
+	ATTACH_OP_ROOT_VER,
+	ATTACH_OP_PWRUP_REASON,
+	ATTACH_OP_GB_VERSION,
+	ATTACH_OP_MANIFEST_SIZE,
+	ATTACH_OPS,
+};
+
 static struct muc_svc_hotplug_work *
 muc_svc_create_hotplug_work(struct mods_dl_device *mods_dev)
 {
 	struct muc_svc_hotplug_work *hpw;
+	struct svc_op *ops[ATTACH_OPS] = { NULL };
+	uint16_t vendor_cport = SVC_VENDOR_CTRL_CPORT(mods_dev->intf_id);
 	int ret;
+	int i;
 
 	hpw = kzalloc(sizeof(*hpw), GFP_KERNEL);
 	if (!hpw)
@@ -1941,7 +2317,7 @@ muc_svc_create_hotplug_work(struct mods_dl_device *mods_dev)
 				MB_CONTROL_TYPE_PROTOCOL_VERSION,
 				MB_CONTROL_VERSION_MAJOR,
 				MB_CONTROL_VERSION_MINOR,
-				SVC_VENDOR_CTRL_CPORT(mods_dev->intf_id),
+				vendor_cport,
 				&mods_dev->mb_ctrl_major,
 				&mods_dev->mb_ctrl_minor);
 	if (ret) {
@@ -1950,6 +2326,7 @@ muc_svc_create_hotplug_work(struct mods_dl_device *mods_dev)
 			mods_dev->intf_id);
 		goto free_route;
 	}
+	muc_svc_trace(mods_dev, MODS_ATTACH_MB_VERSION);
 
 	/* If supported, sync RTC clocks early so the time is correct if a
 	 * failure occurs later in the initialization sequence. This will
@@ -1961,32 +2338,101 @@ muc_svc_create_hotplug_work(struct mods_dl_device *mods_dev)
 			goto free_route;
 	}
 
+	/* None of the remaining requests depend on each other, so send them
+	 * all before waiting on the responses. GET_IDS, GET_ROOT_VER and
+	 * GET_PWRUP_REASON have no payload.
+	 */
+	ops[ATTACH_OP_IDS] = svc_gb_msg_send_async(svc_dd->dld, NULL,
+				MB_CONTROL_TYPE_GET_IDS, 0, vendor_cport, true);
+	if (IS_ERR(ops[ATTACH_OP_IDS])) {
+		ret = PTR_ERR(ops[ATTACH_OP_IDS]);
+		ops[ATTACH_OP_IDS] = NULL;
+		goto cancel_ops;
+	}
+
+	/* Get the hardware's core version if protocol reported support */
+	if (MB_CONTROL_SUPPORTS(mods_dev, GET_ROOT_VER)) {
+		ops[ATTACH_OP_ROOT_VER] = svc_gb_msg_send_async(svc_dd->dld,
+				NULL, MB_CONTROL_TYPE_GET_ROOT_VER, 0,
+				vendor_cport, true);
+		if (IS_ERR(ops[ATTACH_OP_ROOT_VER])) {
+			ret = PTR_ERR(ops[ATTACH_OP_ROOT_VER]);
+			ops[ATTACH_OP_ROOT_VER] = NULL;
+			goto cancel_ops;
+		}
+	}
+
+	if (MB_CONTROL_SUPPORTS(mods_dev, GET_PWRUP_REASON)) {
+		ops[ATTACH_OP_PWRUP_REASON] = svc_gb_msg_send_async(svc_dd->dld,
+				NULL, MB_CONTROL_TYPE_GET_PWRUP_REASON, 0,
+				vendor_cport, true);
+		/* The power up reason is informational only */
+		if (IS_ERR(ops[ATTACH_OP_PWRUP_REASON]))
+			ops[ATTACH_OP_PWRUP_REASON] = NULL;
+	}
+
+	ops[ATTACH_OP_GB_VERSION] = muc_svc_control_version_send(
+				GB_REQUEST_TYPE_PROTOCOL_VERSION,
+				GB_CONTROL_VERSION_MAJOR,
+				GB_CONTROL_VERSION_MINOR,
+				mods_dev->intf_id);
+	if (IS_ERR(ops[ATTACH_OP_GB_VERSION])) {
+		ret = PTR_ERR(ops[ATTACH_OP_GB_VERSION]);
+		ops[ATTACH_OP_GB_VERSION] = NULL;
+		goto cancel_ops;
+	}
+
+	/* GET_SIZE has no payload, it follows VERSION on the same CPort */
+	ops[ATTACH_OP_MANIFEST_SIZE] = svc_gb_msg_send_async(svc_dd->dld,
+				NULL, GB_CONTROL_TYPE_GET_MANIFEST_SIZE, 0,
+				mods_dev->intf_id, true);
+	if (IS_ERR(ops[ATTACH_OP_MANIFEST_SIZE])) {
+		ret = PTR_ERR(ops[ATTACH_OP_MANIFEST_SIZE]);
+		ops[ATTACH_OP_MANIFEST_SIZE] = NULL;
+		goto cancel_ops;
+	}
+
 	/* Get the hotplug IDs */
-	ret = muc_svc_get_hotplug_data(svc_dd->dld, &hpw->hotplug, mods_dev);
+	ret = muc_svc_get_hotplug_data(svc_dd->dld, &hpw->hotplug, mods_dev,
+				ops[ATTACH_OP_IDS]);
+	ops[ATTACH_OP_IDS] = NULL;
 	if (ret)
-		goto free_route;
+		goto cancel_ops;
 
 	hpw->hotplug.intf_id = mods_dev->intf_id;
+	muc_svc_dme_cache_init(mods_dev, &hpw->hotplug);
 
-	/* Get the hardware's core version if protocol reported support */
-	if (MB_CONTROL_SUPPORTS(mods_dev, GET_ROOT_VER)) {
-		ret = muc_svc_get_root_version(svc_dd->dld, mods_dev);
+	if (ops[ATTACH_OP_ROOT_VER]) {
+		ret = muc_svc_get_root_version(svc_dd->dld, mods_dev,
+				ops[ATTACH_OP_ROOT_VER]);
+		ops[ATTACH_OP_ROOT_VER] = NULL;
 		if (ret)
-			goto free_route;
+			goto cancel_ops;
 	}
 
-	if (MB_CONTROL_SUPPORTS(mods_dev, GET_PWRUP_REASON))
-		muc_svc_get_pwrup_reason(svc_dd->dld, mods_dev);
+	if (ops[ATTACH_OP_PWRUP_REASON]) {
+		muc_svc_get_pwrup_reason(svc_dd->dld, mods_dev,
+				ops[ATTACH_OP_PWRUP_REASON]);
+		ops[ATTACH_OP_PWRUP_REASON] = NULL;
+	}
+	muc_svc_trace(mods_dev, MODS_ATTACH_IDS);
 
-	ret = muc_svc_get_manifest(mods_dev, mods_dev->intf_id);
+	ret = muc_svc_get_manifest(mods_dev, mods_dev->intf_id, &hpw->hotplug,
+				ops[ATTACH_OP_GB_VERSION],
+				ops[ATTACH_OP_MANIFEST_SIZE]);
 	if (ret)
 		goto free_route;
+	muc_svc_trace(mods_dev, MODS_ATTACH_MANIFEST);
 
 	muc_svc_destroy_control_route(mods_dev->intf_id,
 				mods_dev->intf_id, GB_CONTROL_CPORT_ID);
 
 	return hpw;
 
+cancel_ops:
+	for (i = 0; i < ATTACH_OPS; i++)
+		if (ops[i])
+			svc_gb_msg_cancel(svc_dd->dld, ops[i]);
 free_route:
 	muc_svc_destroy_control_route(mods_dev->intf_id,
 				mods_dev->intf_id, GB_CONTROL_CPORT_ID);
@@ -2043,6 +2489,8 @@ static int muc_svc_generate_unplug(struct mods_dl_device *mods_dev)
 
 void mods_dl_dev_detached(struct mods_dl_device *mods_dev)
 {
+	bool attached;
+
 	/* AP is special case */
 	if (mods_dev->intf_id == MODS_INTF_AP) {
 		mods_nw_del_route(MODS_INTF_SVC, 0, MODS_INTF_AP, 0);
@@ -2051,18 +2499,28 @@ void mods_dl_dev_detached(struct mods_dl_device *mods_dev)
 		return;
 	}
 
+	/* Drop a pending attach, or wait for one in progress to finish */
+	cancel_work_sync(&mods_dev->attach_work);
+
 	muc_svc_destroy_dl_dev_sysfs(mods_dev);
 
+	/* A failed attach has already removed itself and its routes */
 	mutex_lock(&svc_list_lock);
-	list_del(&mods_dev->list);
+	attached = !list_empty(&mods_dev->list);
+	list_del_init(&mods_dev->list);
 	mutex_unlock(&svc_list_lock);
 
-	muc_svc_generate_unplug(mods_dev);
+	if (attached) {
+		if (mods_dev->hpw)
+			cancel_work_sync(&mods_dev->hpw->work);
 
-	/* Destroy custom vendor control route */
-	muc_svc_destroy_control_route(mods_dev->intf_id,
-			SVC_VENDOR_CTRL_CPORT(mods_dev->intf_id),
-			VENDOR_CTRL_DEST_CPORT);
+		muc_svc_generate_unplug(mods_dev);
+
+		/* Destroy custom vendor control route */
+		muc_svc_destroy_control_route(mods_dev->intf_id,
+				SVC_VENDOR_CTRL_CPORT(mods_dev->intf_id),
+				VENDOR_CTRL_DEST_CPORT);
+	}
 
 	kfree(mods_dev->manifest);
 	kfree(mods_dev->hpw);
@@ -2077,8 +2535,64 @@ void mods_dl_dev_detached(struct mods_dl_device *mods_dev)
 }
 EXPORT_SYMBOL_GPL(mods_dl_dev_detached);
 
+/* Bring up an external interface. Each interface has its own attach
+ * context on the unbound attach workqueue, so the control exchanges of
+ * a master and its slaves, or of independent mods, run concurrently.
+ * The DL driver learns the outcome through its attach_done callback.
+ */
+static void muc_svc_intf_attach_work(struct work_struct *work)
+{
+	struct mods_dl_device *mods_dev;
+	int err;
+
+	mods_dev = container_of(work, struct mods_dl_device, attach_work);
+
+	/* Create route for vendor control protocol on reserved CPORT */
+	err = muc_svc_create_control_route(mods_dev->intf_id,
+				SVC_VENDOR_CTRL_CPORT(mods_dev->intf_id),
+				VENDOR_CTRL_DEST_CPORT);
+	if (err) {
+		dev_err(&svc_dd->pdev->dev,
+			"[%d] VENDOR CONTROL setup failed\n",
+			mods_dev->intf_id);
+		goto recovery;
+	}
+
+	err = muc_svc_generate_hotplug(mods_dev);
+	if (err)
+		goto free_ext_ctrl;
+
+	/* Got successful external interface notification, can cancel wdog */
+	muc_svc_clear_wdog(mods_dev);
+
+	if (mods_dev->drv->attach_done)
+		mods_dev->drv->attach_done(mods_dev, 0);
+
+	return;
+
+free_ext_ctrl:
+	muc_svc_destroy_control_route(mods_dev->intf_id,
+			SVC_VENDOR_CTRL_CPORT(mods_dev->intf_id),
+			VENDOR_CTRL_DEST_CPORT);
+recovery:
+	mutex_lock(&svc_list_lock);
+	list_del_init(&mods_dev->list);
+	mutex_unlock(&svc_list_lock);
+
+	/* Only do a recovery if the mod still here, if it was removed
+	 * we likely failed due to that.
+	 */
+	if (!svc_dd->mod_attached)
+		muc_svc_recovery();
+
+	if (mods_dev->drv->attach_done)
+		mods_dev->drv->attach_done(mods_dev, err);
+}
+
 /* Notifies that the DL device is in attached state and the
- * hotplug event can be kicked off
+ * hotplug event can be kicked off. For external interfaces only the
+ * initial checks are reported here, the attach itself completes in the
+ * background and its result goes to the driver's attach_done callback.
  */
 int mods_dl_dev_attached(struct mods_dl_device *mods_dev)
 {
@@ -2117,43 +2631,14 @@ int mods_dl_dev_attached(struct mods_dl_device *mods_dev)
 	list_add_tail(&mods_dev->list, &svc_dd->ext_intf);
 	mutex_unlock(&svc_list_lock);
 
-	/* Create route for vendor control protocol on reserved CPORT */
-	err = muc_svc_create_control_route(mods_dev->intf_id,
-				SVC_VENDOR_CTRL_CPORT(mods_dev->intf_id),
-				VENDOR_CTRL_DEST_CPORT);
-	if (err) {
-		dev_err(&svc_dd->pdev->dev,
-			"[%d] VENDOR CONTROL setup failed\n",
-			mods_dev->intf_id);
-		goto recovery;
-	}
-
-	err = muc_svc_generate_hotplug(mods_dev);
-	if (err)
-		goto free_ext_ctrl;
+	memset(mods_dev->attach_trace, 0, sizeof(mods_dev->attach_trace));
+	mods_dev->attach_trace[MODS_ATTACH_DETECT] = svc_dd->attach_time;
+	muc_svc_trace(mods_dev, MODS_ATTACH_DL_READY);
 
-	/* Got successful external interface notification, can cancel wdog */
-	muc_svc_clear_wdog(mods_dev);
+	queue_work(svc_dd->attach_wq, &mods_dev->attach_work);
 
 	return 0;
 
-free_ext_ctrl:
-	muc_svc_destroy_control_route(mods_dev->intf_id,
-			SVC_VENDOR_CTRL_CPORT(mods_dev->intf_id),
-			VENDOR_CTRL_DEST_CPORT);
-recovery:
-	mutex_lock(&svc_list_lock);
-	list_del(&mods_dev->list);
-	mutex_unlock(&svc_list_lock);
-
-	/* Only do a recovery if the mod still here, if it was removed
-	 * we likely failed due to that.
-	 */
-	if (!svc_dd->mod_attached)
-		muc_svc_recovery();
-
-	return err;
-
 free_ap_to_svc:
 	mods_nw_del_route(MODS_INTF_AP, 0, MODS_INTF_SVC, 0);
 free_svc_to_ap:
@@ -2175,6 +2660,8 @@ struct mods_dl_device *_mods_create_dl_device(struct mods_dl_driver *drv,
 		return ERR_PTR(-ENOMEM);
 
 	kref_init(&mods_dev->kref);
+	INIT_LIST_HEAD(&mods_dev->list);
+	INIT_WORK(&mods_dev->attach_work, muc_svc_intf_attach_work);
 	mods_dev->drv = drv;
 	mods_dev->dev = dev;
 	mods_dev->intf_id = intf_id;
@@ -2191,11 +2678,7 @@ struct mods_dl_device *_mods_create_dl_device(struct mods_dl_driver *drv,
 
 void mods_dl_device_get(struct mods_dl_device *mods_dev)
 {
-	unsigned long flags;
-
-	spin_lock_irqsave(&svc_ops_lock, flags);
 	kref_get(&mods_dev->kref);
-	spin_unlock_irqrestore(&svc_ops_lock, flags);
 }
 
 struct mods_dl_device *mods_create_dl_device(struct mods_dl_driver *drv,
@@ -2220,11 +2703,7 @@ static void mods_dl_device_free(struct kref *kref)
 
 void mods_dl_device_put(struct mods_dl_device *mods_dev)
 {
-	unsigned long flags;
-
-	spin_lock_irqsave(&svc_ops_lock, flags);
 	kref_put(&mods_dev->kref, mods_dl_device_free);
-	spin_unlock_irqrestore(&svc_ops_lock, flags);
 }
 
 void mods_remove_dl_device(struct mods_dl_device *dev)
@@ -2419,6 +2898,9 @@ svc_filter_ap_connected(struct mods_dl_device *orig_dev,
 	struct muc_msg *mm = (struct muc_msg *)payload;
 	struct gb_operation_msg_hdr *hdr;
 
+	if (!ktime_to_ns(orig_dev->attach_trace[MODS_ATTACH_CONNECTED]))
+		muc_svc_trace(orig_dev, MODS_ATTACH_CONNECTED);
+
 	/* Pull out the cport ID from the connected request */
 	hdr = (struct gb_operation_msg_hdr *)mm->gb_msg;
 	req = (struct gb_control_connected_request *)(hdr + 1);
@@ -2793,11 +3275,65 @@ recovery_mode_store(struct device *dev, struct device_attribute *attr,
 }
 static DEVICE_ATTR_WO(recovery_mode);
 
+static ssize_t op_stats_show(struct device *dev, struct device_attribute *attr,
+			     char *buf)
+{
+	struct platform_device *pdev = to_platform_device(dev);
+	struct muc_svc_data *dd = platform_get_drvdata(pdev);
+	struct svc_op_stats stats;
+	unsigned long flags;
+
+	spin_lock_irqsave(&dd->ops_lock, flags);
+	stats = dd->op_stats;
+	spin_unlock_irqrestore(&dd->ops_lock, flags);
+
+	return scnprintf(buf, PAGE_SIZE,
+		"lookups: %llu\nmisses: %llu\ncompleted: %llu\n"
+		"timeouts: %llu\nlatency_avg_us: %llu\nlatency_max_us: %llu\n",
+		stats.lookups, stats.misses, stats.completed, stats.timeouts,
+		stats.completed ?
+			div64_u64(stats.latency_total_us, stats.completed) : 0,
+		stats.latency_max_us);
+}
+static DEVICE_ATTR_RO(op_stats);
+
+static ssize_t manifest_cache_show(struct device *dev,
+				   struct device_attribute *attr, char *buf)
+{
+	ssize_t count;
+
+	mutex_lock(&manifest_cache_lock);
+	count = scnprintf(buf, PAGE_SIZE, "entries: %u\nhits: %lu\nmisses: %lu\n",
+			  manifest_cache_count, manifest_cache_hits,
+			  manifest_cache_misses);
+	mutex_unlock(&manifest_cache_lock);
+
+	return count;
+}
+
+static ssize_t manifest_cache_store(struct device *dev,
+				    struct device_attribute *attr,
+				    const char *buf, size_t count)
+{
+	unsigned long val;
+
+	if (kstrtoul(buf, 10, &val) < 0 || val != 0)
+		return -EINVAL;
+
+	/* Writing 0 drops all cached manifests */
+	manifest_cache_flush();
+
+	return count;
+}
+static DEVICE_ATTR_RW(manifest_cache);
+
 static struct attribute *muc_svc_base_attrs[] = {
 	&dev_attr_flashmode.attr,
 	&dev_attr_forcedetect.attr,
 	&dev_attr_reset.attr,
 	&dev_attr_recovery_mode.attr,
+	&dev_attr_op_stats.attr,
+	&dev_attr_manifest_cache.attr,
 	NULL,
 };
 ATTRIBUTE_GROUPS(muc_svc_base);
@@ -2866,19 +3402,28 @@ static int muc_svc_probe(struct platform_device *pdev)
 		goto free_dl_dev;
 	}
 
+	/* Interfaces attach independently of each other */
+	dd->attach_wq = alloc_workqueue("muc_svc_intf_attach", WQ_UNBOUND, 0);
+	if (!dd->attach_wq) {
+		dev_err(&pdev->dev, "Failed to create intf attach workqueue.\n");
+		ret = -ENOMEM;
+		goto free_wq;
+	}
+
 	INIT_DELAYED_WORK(&dd->wdog_work, muc_svc_wdog);
 	dd->wdog_wq = alloc_workqueue("muc_svc_wdog", WQ_UNBOUND, 1);
-	if (!dd->wq) {
+	if (!dd->wdog_wq) {
 		dev_err(&pdev->dev, "Failed to create WDOG workqueue.\n");
 		ret = -ENOMEM;
-		goto free_wq;
+		goto free_attach_wq;
 	}
 
 	dd->dld->dl_priv = dd;
 
 	dd->pdev = pdev;
 	atomic_set(&dd->msg_num, 1);
-	INIT_LIST_HEAD(&dd->operations);
+	spin_lock_init(&dd->ops_lock);
+	hash_init(dd->operations);
 	INIT_LIST_HEAD(&dd->ext_intf);
 	INIT_LIST_HEAD(&dd->slave_drv);
 	wake_lock_init(&dd->wlock, WAKE_LOCK_SUSPEND, "muc_svc");
@@ -2917,6 +3462,8 @@ free_kset:
 free_wdog_wq:
 	destroy_workqueue(dd->wdog_wq);
 	wake_lock_destroy(&dd->wlock);
+free_attach_wq:
+	destroy_workqueue(dd->attach_wq);
 free_wq:
 	destroy_workqueue(dd->wq);
 free_dl_dev:
@@ -2934,9 +3481,11 @@ static int muc_svc_remove(struct platform_device *pdev)
 	muc_svc_base_sysfs_exit(dd);
 	cancel_delayed_work_sync(&dd->wdog_work);
 	destroy_workqueue(dd->wdog_wq);
+	destroy_workqueue(dd->attach_wq);
 	destroy_workqueue(dd->wq);
 	wake_lock_destroy(&dd->wlock);
 	mods_remove_dl_device(dd->dld);
+	manifest_cache_flush();
 
 	return 0;
 }
@@ -2957,13 +3506,60 @@ static struct platform_driver muc_svc_driver = {
 	.remove  = muc_svc_remove,
 };
 
+static void muc_svc_destroy_pools(void)
+{
+	if (svc_op_pool)
+		mempool_destroy(svc_op_pool);
+	if (svc_msg_pool)
+		mempool_destroy(svc_msg_pool);
+	if (svc_op_cache)
+		kmem_cache_destroy(svc_op_cache);
+	if (svc_msg_cache)
+		kmem_cache_destroy(svc_msg_cache);
+}
+
+static int muc_svc_create_pools(void)
+{
+	svc_msg_cache = kmem_cache_create("muc_svc_msg_cache",
+				SVC_MSG_POOL_SIZE, 0, 0, NULL);
+	if (!svc_msg_cache)
+		goto err;
+
+	svc_op_cache = kmem_cache_create("muc_svc_op_cache",
+				sizeof(struct svc_op), 0, 0, NULL);
+	if (!svc_op_cache)
+		goto err;
+
+	svc_msg_pool = mempool_create_slab_pool(SVC_MSG_POOL_MIN,
+				svc_msg_cache);
+	if (!svc_msg_pool)
+		goto err;
+
+	svc_op_pool = mempool_create_slab_pool(SVC_OP_POOL_MIN, svc_op_cache);
+	if (!svc_op_pool)
+		goto err;
+
+	return 0;
+
+err:
+	muc_svc_destroy_pools();
+	return -ENOMEM;
+}
+
 int __init muc_svc_init(void)
 {
 	int ret;
 
+	ret = muc_svc_create_pools();
+	if (ret) {
+		pr_err("muc_svc failed to create message pools\n");
+		return ret;
+	}
+
 	ret = platform_driver_register(&muc_svc_driver);
 	if (ret < 0) {
 		pr_err("muc_svc failed to register driver\n");
+		muc_svc_destroy_pools();
 		return ret;
 	}
 
@@ -2973,4 +3569,5 @@ int __init muc_svc_init(void)
 void muc_svc_exit(void)
 {
 	platform_driver_unregister(&muc_svc_driver);
+	muc_svc_destroy_pools();
 }
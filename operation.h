@@ -100,6 +100,7 @@ struct gb_operation {
 
 	struct work_struct	work;
 	gb_operation_callback	callback;
+	void			*private;	/* for the caller's use */
 	struct completion	completion;
 
 	struct kref		kref;
@@ -15,8 +15,13 @@
 #include <linux/idr.h>
 #include <linux/uaccess.h>
 #include <linux/poll.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/log2.h>
+#include <linux/workqueue.h>
 
 #include "greybus.h"
+#include "raw.h"
 
 enum gb_raw_state {
 	GB_RAW_READY = 0,
@@ -28,6 +33,8 @@ struct gb_raw {
 
 	struct list_head list;
 	int list_data;
+	int max_data_size;
+	bool read_framed;
 	struct mutex list_lock;
 	dev_t dev;
 	struct cdev cdev;
@@ -35,16 +42,54 @@ struct gb_raw {
 	wait_queue_head_t read_wq;
 	atomic_t open_excl;
 
+	/*
+	 * shared receive ring, set up by mmap() and freed with its last
+	 * mapping.  ring_lock nests inside list_lock and inside mmap_sem, so
+	 * it is never held across a copy to or from userspace.
+	 */
+	struct mutex ring_lock;
+	struct gb_raw_ring_ctrl *ring;
+	u8 *ring_data;
+	u32 ring_size;
+	u32 ring_head;
+	u32 ring_dropped;
+	unsigned int ring_maps;	/* vmas mapping the ring */
+
+	/* non-blocking writes, protected by tx_lock */
+	spinlock_t tx_lock;
+	wait_queue_head_t write_wq;
+	unsigned int tx_window;
+	unsigned int tx_inflight;
+	int tx_error;
+
 	struct kref kref;
 	enum gb_raw_state state;
 };
 
+/* An in-flight non-blocking write and the timer that cancels it */
+struct gb_raw_tx {
+	struct gb_operation *operation;
+	struct delayed_work timeout;
+};
+
 struct raw_data {
 	struct list_head entry;
 	u32 len;
 	u8 data[0];
 };
 
+/*
+ * The user memory a read or write copies to or from: a plain buffer, or an
+ * iov_iter for readv() and writev().
+ */
+struct raw_io {
+	void __user *buf;
+#ifdef FILE_OPS_HAVE_ITER
+	struct iov_iter *iter;
+#endif
+	size_t count;
+};
+
 static struct class *raw_class;
 static int raw_major;
 static const struct file_operations raw_fops;
@@ -58,11 +103,20 @@ static DEFINE_SPINLOCK(raw_lock);
 #define MAX_PACKET_SIZE	(PAGE_SIZE * 2)
 
 /*
- * Maximum size of the data in the receive buffer we allow before we start to
- * drop messages on the floor
+ * Default maximum size of the data in the receive buffer we allow before we
+ * start to drop messages on the floor, and the largest value max_data_size
+ * can be set to
  */
-#define MAX_DATA_SIZE	(MAX_PACKET_SIZE * 8)
+#define MAX_DATA_SIZE		(MAX_PACKET_SIZE * 8)
+#define MAX_DATA_SIZE_LIMIT	SZ_16M
+
+/* Limits on the data area of the shared receive ring */
+#define RING_MIN_SIZE	(MAX_PACKET_SIZE * 2)
+#define RING_MAX_SIZE	SZ_16M
 
+/* Default and maximum number of non-blocking writes in flight */
+#define WRITE_WINDOW		8
+#define WRITE_WINDOW_MAX	64
 
 static void gb_raw_kref_release(struct kref *kref)
 {
@@ -94,7 +148,70 @@ static inline void gb_raw_put(struct gb_raw *raw)
 }
 
 /*
- * Add the raw data message to the list of received messages.
+ * Copy a packet into the shared ring.  Only the copies of head, size and
+ * dropped kept in struct gb_raw are trusted, userspace can scribble over the
+ * control page.
+ * Must be called with ring_lock held.
+ */
+static int ring_push(struct gb_raw *raw, u32 len, const u8 *data)
+{
+	struct gb_raw_ring_hdr *hdr;
+	u32 size = raw->ring_size;
+	u32 head = raw->ring_head;
+	u32 rec = GB_RAW_RING_REC_SIZE(len);
+	u32 off = head & (size - 1);
+	u32 pad = 0;
+	u32 used;
+
+	/* pairs with the consumer's release of tail */
+	used = head - smp_load_acquire(&raw->ring->tail);
+
+	if (off + rec > size)
+		pad = size - off;
+
+	if (used > size || size - used < pad + rec) {
+		raw->ring->dropped = ++raw->ring_dropped;
+		return -ENOSPC;
+	}
+
+	if (pad) {
+		hdr = (struct gb_raw_ring_hdr *)&raw->ring_data[off];
+		hdr->len = GB_RAW_RING_WRAP;
+		head += pad;
+		off = 0;
+	}
+
+	hdr = (struct gb_raw_ring_hdr *)&raw->ring_data[off];
+	hdr->len = len;
+	memcpy(&hdr->data[0], data, len);
+	head += rec;
+
+	raw->ring_head = head;
+	smp_store_release(&raw->ring->head, head);
+
+	return 0;
+}
+
+/*
+ * Move packets queued for read() before the ring was mapped into the ring.
+ * Must be called with list_lock and ring_lock held.
+ */
+static void ring_fill(struct gb_raw *raw)
+{
+	struct raw_data *raw_data;
+	struct raw_data *temp;
+
+	list_for_each_entry_safe(raw_data, temp, &raw->list, entry) {
+		ring_push(raw, raw_data->len, &raw_data->data[0]);
+		list_del(&raw_data->entry);
+		kfree(raw_data);
+	}
+	raw->list_data = 0;
+}
+
+/*
+ * Add the raw data message to the shared ring if userspace mapped one, or to
+ * the list of received messages otherwise.
  */
 static int receive_data(struct gb_raw *raw, u32 len, u8 *data)
 {
@@ -108,7 +225,20 @@ static int receive_data(struct gb_raw *raw, u32 len, u8 *data)
 	}
 
 	mutex_lock(&raw->list_lock);
-	if ((raw->list_data + len) > MAX_DATA_SIZE) {
+	mutex_lock(&raw->ring_lock);
+	if (raw->ring) {
+		ring_fill(raw);
+		retval = ring_push(raw, len, data);
+		mutex_unlock(&raw->ring_lock);
+		if (retval)
+			dev_err_ratelimited(dev, "receive ring full, dropping packets\n");
+		else
+			wake_up(&raw->read_wq);
+		goto exit;
+	}
+	mutex_unlock(&raw->ring_lock);
+
+	if ((raw->list_data + len) > raw->max_data_size) {
 		dev_err(dev, "Too much data in receive buffer, now dropping packets\n");
 		retval = -EINVAL;
 		goto exit;
@@ -170,7 +300,41 @@ static int gb_raw_receive(u8 type, struct gb_operation *op)
 	return receive_data(raw, len, receive->data);
 }
 
-static int gb_raw_send(struct gb_raw *raw, u32 len, const char __user *data)
+static int raw_io_to(struct raw_io *io, const void *src, size_t len)
+{
+#ifdef FILE_OPS_HAVE_ITER
+	if (io->iter) {
+		if (copy_to_iter(src, len, io->iter) != len)
+			return -EFAULT;
+		io->count -= len;
+		return 0;
+	}
+#endif
+	if (copy_to_user(io->buf, src, len))
+		return -EFAULT;
+	io->buf += len;
+	io->count -= len;
+	return 0;
+}
+
+static int raw_io_from(struct raw_io *io, void *dst, size_t len)
+{
+#ifdef FILE_OPS_HAVE_ITER
+	if (io->iter) {
+		if (copy_from_iter(dst, len, io->iter) != len)
+			return -EFAULT;
+		io->count -= len;
+		return 0;
+	}
+#endif
+	if (copy_from_user(dst, io->buf, len))
+		return -EFAULT;
+	io->buf += len;
+	io->count -= len;
+	return 0;
+}
+
+static int gb_raw_send(struct gb_raw *raw, u32 len, struct raw_io *io)
 {
 	struct gb_connection *connection = raw->connection;
 	struct gb_raw_send_request *request;
@@ -180,7 +344,7 @@ static int gb_raw_send(struct gb_raw *raw, u32 len, const char __user *data)
 	if (!request)
 		return -ENOMEM;
 
-	if (copy_from_user(&request->data[0], data, len)) {
+	if (raw_io_from(io, &request->data[0], len)) {
 		kfree(request);
 		return -EFAULT;
 	}
@@ -195,6 +359,182 @@ static int gb_raw_send(struct gb_raw *raw, u32 len, const char __user *data)
 	return retval;
 }
 
+/*
+ * Completion of a non-blocking write.  The first error is kept until it has
+ * been reported to userspace.
+ */
+static void gb_raw_send_callback(struct gb_operation *operation)
+{
+	struct gb_raw *raw = operation->connection->private;
+	struct gb_raw_tx *tx = operation->private;
+	int result = gb_operation_result(operation);
+
+	/*
+	 * gb_operation_cancel() waits for this callback to return, so the
+	 * timeout cannot be cancelled synchronously here.  If it has already
+	 * started it releases the operation and tx itself.
+	 */
+	if (cancel_delayed_work(&tx->timeout)) {
+		gb_operation_put(operation);
+		kfree(tx);
+	}
+
+	spin_lock(&raw->tx_lock);
+	if (result && !raw->tx_error)
+		raw->tx_error = result;
+	raw->tx_inflight--;
+	spin_unlock(&raw->tx_lock);
+
+	wake_up(&raw->write_wq);
+	gb_raw_put(raw);
+}
+
+/*
+ * A non-blocking write gets the same timeout as a synchronous one.  The
+ * cancellation completes the operation with -ETIMEDOUT, which the callback
+ * reports like any other error.
+ */
+static void gb_raw_send_timeout(struct work_struct *work)
+{
+	struct gb_raw_tx *tx = container_of(to_delayed_work(work),
+					    struct gb_raw_tx, timeout);
+
+	gb_operation_cancel(tx->operation, -ETIMEDOUT);
+	gb_operation_put(tx->operation);
+	kfree(tx);
+}
+
+/*
+ * Start a send operation without waiting for the response.  The caller must
+ * have reserved a slot in the write window.
+ */
+static int gb_raw_send_async(struct gb_raw *raw, u32 len, struct raw_io *io)
+{
+	struct gb_connection *connection = raw->connection;
+	struct gb_raw_send_request *request;
+	struct gb_operation *operation;
+	struct gb_raw_tx *tx;
+	int retval;
+
+	tx = kzalloc(sizeof(*tx), GFP_KERNEL);
+	if (!tx)
+		return -ENOMEM;
+
+	operation = gb_operation_create(connection, GB_RAW_TYPE_SEND,
+					len + sizeof(*request), 0, GFP_KERNEL);
+	if (!operation) {
+		retval = -ENOMEM;
+		goto error_free_tx;
+	}
+
+	request = operation->request->payload;
+	if (raw_io_from(io, &request->data[0], len)) {
+		retval = -EFAULT;
+		goto error_put_operation;
+	}
+	request->len = cpu_to_le32(len);
+
+	/* the timeout holds its own reference to the operation */
+	tx->operation = operation;
+	INIT_DELAYED_WORK(&tx->timeout, gb_raw_send_timeout);
+	operation->private = tx;
+	gb_operation_get(operation);
+	schedule_delayed_work(&tx->timeout,
+			msecs_to_jiffies(GB_OPERATION_TIMEOUT_DEFAULT));
+
+	/* dropped by the callback */
+	gb_raw_get(raw);
+	retval = gb_operation_request_send(operation, gb_raw_send_callback,
+					   GFP_KERNEL);
+	if (retval) {
+		gb_raw_put(raw);
+		if (cancel_delayed_work_sync(&tx->timeout)) {
+			gb_operation_put(operation);
+			kfree(tx);
+		}
+	}
+
+	gb_operation_put(operation);
+	return retval;
+
+error_put_operation:
+	gb_operation_put(operation);
+error_free_tx:
+	kfree(tx);
+	return retval;
+}
+
+static ssize_t write_window_show(struct device *dev,
+				 struct device_attribute *attr, char *buf)
+{
+	struct gb_raw *raw = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%u\n", raw->tx_window);
+}
+
+static ssize_t write_window_store(struct device *dev,
+				  struct device_attribute *attr,
+				  const char *buf, size_t len)
+{
+	struct gb_raw *raw = dev_get_drvdata(dev);
+	unsigned int window;
+	int retval;
+
+	retval = kstrtouint(buf, 0, &window);
+	if (retval)
+		return retval;
+
+	if (!window || window > WRITE_WINDOW_MAX)
+		return -EINVAL;
+
+	spin_lock(&raw->tx_lock);
+	raw->tx_window = window;
+	spin_unlock(&raw->tx_lock);
+	wake_up(&raw->write_wq);
+
+	return len;
+}
+static DEVICE_ATTR_RW(write_window);
+
+static ssize_t max_data_size_show(struct device *dev,
+				  struct device_attribute *attr, char *buf)
+{
+	struct gb_raw *raw = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%d\n", raw->max_data_size);
+}
+
+static ssize_t max_data_size_store(struct device *dev,
+				   struct device_attribute *attr,
+				   const char *buf, size_t len)
+{
+	struct gb_raw *raw = dev_get_drvdata(dev);
+	int size;
+	int retval;
+
+	retval = kstrtoint(buf, 0, &size);
+	if (retval)
+		return retval;
+
+	if (size < MAX_PACKET_SIZE || size > MAX_DATA_SIZE_LIMIT)
+		return -EINVAL;
+
+	/* already queued data is kept, new packets are dropped until it fits */
+	mutex_lock(&raw->list_lock);
+	raw->max_data_size = size;
+	mutex_unlock(&raw->list_lock);
+
+	return len;
+}
+static DEVICE_ATTR_RW(max_data_size);
+
+static struct attribute *raw_attrs[] = {
+	&dev_attr_write_window.attr,
+	&dev_attr_max_data_size.attr,
+	NULL,
+};
+ATTRIBUTE_GROUPS(raw);
+
 static void gb_raw_dev_release(struct device *dev)
 {
 	struct gb_raw *raw = dev_get_drvdata(dev);
@@ -219,7 +559,11 @@ static int gb_raw_connection_init(struct gb_connection *connection)
 	raw->state = GB_RAW_READY;
 
 	INIT_LIST_HEAD(&raw->list);
+	raw->max_data_size = MAX_DATA_SIZE;
 	mutex_init(&raw->list_lock);
+	mutex_init(&raw->ring_lock);
+	spin_lock_init(&raw->tx_lock);
+	raw->tx_window = WRITE_WINDOW;
 
 	minor = ida_simple_get(&minors, 0, 0, GFP_KERNEL);
 	if (minor < 0) {
@@ -237,10 +581,12 @@ static int gb_raw_connection_init(struct gb_connection *connection)
 	raw->device->class = raw_class;
 	raw->device->parent = &connection->bundle->dev;
 	raw->device->release = gb_raw_dev_release;
+	raw->device->groups = raw_groups;
 	dev_set_name(raw->device, "gbraw%d", minor);
 	device_initialize(raw->device);
 
 	init_waitqueue_head(&raw->read_wq);
+	init_waitqueue_head(&raw->write_wq);
 	atomic_set(&raw->open_excl, 0);
 	raw->dev = MKDEV(raw_major, minor);
 	cdev_init(&raw->cdev, &raw_fops);
@@ -281,6 +627,7 @@ static void gb_raw_connection_exit(struct gb_connection *connection)
 
 	raw->state = GB_RAW_DESTROYED;
 	wake_up(&raw->read_wq);
+	wake_up(&raw->write_wq);
 
 	cdev_del(&raw->cdev);
 	device_del(raw->device);
@@ -310,7 +657,17 @@ static struct gb_protocol raw_protocol = {
  * Note, we are using read/write to only allow a single read/write per message.
  * This means for read(), you have to provide a big enough buffer for the full
  * message to be copied into.  If the buffer isn't big enough, the read() will
- * fail with -ENOSPC.
+ * fail with -ENOSPC.  A framed read, selected with GB_RAW_IOC_SET_FRAMED,
+ * returns as many packets as fit instead, each preceded by its length.
+ * readv() and writev() behave the same, a writev() sends a single message.
+ *
+ * While the device is mapped, received messages go to the shared ring
+ * described in raw.h instead and read() fails with -EBUSY.
+ *
+ * A write() on a file opened with O_NONBLOCK returns as soon as the request
+ * has been queued, with up to write_window requests in flight.  It fails with
+ * -EAGAIN while the window is full.  A failed request is reported by the next
+ * write() or fsync(), and as POLLERR until then.
  */
 
 static int raw_open(struct inode *inode, struct file *file)
@@ -322,15 +679,16 @@ static int raw_open(struct inode *inode, struct file *file)
 		return -EBUSY;
 
 	gb_raw_get(raw);
+	raw->read_framed = false;
 	file->private_data = raw;
 
 	return 0;
 }
 
-static ssize_t raw_write(struct file *file, const char __user *buf,
-			 size_t count, loff_t *ppos)
+static ssize_t raw_write_io(struct file *file, struct raw_io *io)
 {
 	struct gb_raw *raw = file->private_data;
+	size_t count = io->count;
 	int retval;
 
 	if (!count)
@@ -339,27 +697,101 @@ static ssize_t raw_write(struct file *file, const char __user *buf,
 	if (count > MAX_PACKET_SIZE)
 		return -E2BIG;
 
-	retval = gb_raw_send(raw, count, buf);
+	if (file->f_flags & O_NONBLOCK) {
+		spin_lock(&raw->tx_lock);
+		retval = raw->tx_error;
+		raw->tx_error = 0;
+		if (!retval) {
+			if (raw->tx_inflight < raw->tx_window)
+				raw->tx_inflight++;
+			else
+				retval = -EAGAIN;
+		}
+		spin_unlock(&raw->tx_lock);
+		if (retval)
+			return retval;
+
+		retval = gb_raw_send_async(raw, count, io);
+		if (retval) {
+			spin_lock(&raw->tx_lock);
+			raw->tx_inflight--;
+			spin_unlock(&raw->tx_lock);
+			wake_up(&raw->write_wq);
+			return retval;
+		}
+
+		return count;
+	}
+
+	retval = gb_raw_send(raw, count, io);
 	if (retval)
 		return retval;
 
 	return count;
 }
 
-static ssize_t raw_read(struct file *file, char __user *buf, size_t count,
-			loff_t *ppos)
+static ssize_t raw_write(struct file *file, const char __user *buf,
+			 size_t count, loff_t *ppos)
+{
+	struct raw_io io = {
+		.buf	= (void __user *)buf,
+		.count	= count,
+	};
+
+	return raw_write_io(file, &io);
+}
+
+static void raw_data_free(struct gb_raw *raw, struct raw_data *raw_data)
+{
+	list_del(&raw_data->entry);
+	raw->list_data -= raw_data->len;
+	kfree(raw_data);
+}
+
+/*
+ * Copy as many queued packets as fit, each preceded by its length.  Must be
+ * called with list_lock held and at least one packet queued.
+ */
+static ssize_t raw_read_framed(struct gb_raw *raw, struct raw_io *io)
+{
+	struct gb_raw_frame_hdr hdr;
+	struct raw_data *raw_data;
+	struct raw_data *temp;
+	ssize_t copied = 0;
+	int retval;
+
+	list_for_each_entry_safe(raw_data, temp, &raw->list, entry) {
+		if (sizeof(hdr) + raw_data->len > io->count)
+			break;
+
+		hdr.len = raw_data->len;
+		retval = raw_io_to(io, &hdr, sizeof(hdr));
+		if (!retval)
+			retval = raw_io_to(io, &raw_data->data[0],
+					   raw_data->len);
+		if (retval)
+			return copied ? copied : retval;
+
+		copied += sizeof(hdr) + raw_data->len;
+		raw_data_free(raw, raw_data);
+	}
+
+	return copied ? copied : -ENOSPC;
+}
+
+static ssize_t raw_read_io(struct file *file, struct raw_io *io)
 {
 	struct gb_raw *raw = file->private_data;
-	int retval = 0;
+	ssize_t retval = 0;
 	struct raw_data *raw_data;
 
 	mutex_lock(&raw->list_lock);
-	if (list_empty(&raw->list)) {
+	if (list_empty(&raw->list) && !raw->ring) {
 		if (!(file->f_flags & O_NONBLOCK)) {
 			do {
 				mutex_unlock(&raw->list_lock);
 				retval = wait_event_interruptible(raw->read_wq,
-				    !list_empty(&raw->list) ||
+				    !list_empty(&raw->list) || raw->ring ||
 				    raw->state == GB_RAW_DESTROYED);
 
 				if (retval < 0)
@@ -368,64 +800,261 @@ static ssize_t raw_read(struct file *file, char __user *buf, size_t count,
 					return -ENOTCONN;
 
 				mutex_lock(&raw->list_lock);
-			} while (list_empty(&raw->list));
+			} while (list_empty(&raw->list) && !raw->ring);
 		} else
 			goto exit;
 	}
 
+	if (raw->ring) {
+		mutex_lock(&raw->ring_lock);
+		if (raw->ring)
+			ring_fill(raw);
+		mutex_unlock(&raw->ring_lock);
+		retval = -EBUSY;
+		goto exit;
+	}
+
+	if (raw->read_framed) {
+		retval = raw_read_framed(raw, io);
+		goto exit;
+	}
+
 	raw_data = list_first_entry(&raw->list, struct raw_data, entry);
-	if (raw_data->len > count) {
+	if (raw_data->len > io->count) {
 		retval = -ENOSPC;
 		goto exit;
 	}
 
-	if (copy_to_user(buf, &raw_data->data[0], raw_data->len)) {
-		retval = -EFAULT;
+	retval = raw_io_to(io, &raw_data->data[0], raw_data->len);
+	if (retval)
 		goto exit;
-	}
 
-	list_del(&raw_data->entry);
-	raw->list_data -= raw_data->len;
 	retval = raw_data->len;
-	kfree(raw_data);
+	raw_data_free(raw, raw_data);
 
 exit:
 	mutex_unlock(&raw->list_lock);
 	return retval;
 }
 
+static ssize_t raw_read(struct file *file, char __user *buf, size_t count,
+			loff_t *ppos)
+{
+	struct raw_io io = {
+		.buf	= buf,
+		.count	= count,
+	};
+
+	return raw_read_io(file, &io);
+}
+
+#ifdef FILE_OPS_HAVE_ITER
+static ssize_t raw_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct raw_io io = {
+		.iter	= from,
+		.count	= iov_iter_count(from),
+	};
+
+	return raw_write_io(iocb->ki_filp, &io);
+}
+
+static ssize_t raw_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct raw_io io = {
+		.iter	= to,
+		.count	= iov_iter_count(to),
+	};
+
+	return raw_read_io(iocb->ki_filp, &io);
+}
+#endif
+
+static long raw_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	struct gb_raw *raw = file->private_data;
+	u32 val;
+
+	switch (cmd) {
+	case GB_RAW_IOC_SET_FRAMED:
+		if (get_user(val, (u32 __user *)arg))
+			return -EFAULT;
+
+		mutex_lock(&raw->list_lock);
+		raw->read_framed = !!val;
+		mutex_unlock(&raw->list_lock);
+		return 0;
+	default:
+		return -ENOTTY;
+	}
+}
+
 static int raw_release(struct inode *inode, struct file *file)
 {
 	struct gb_raw *raw = file->private_data;
 
+	/* every mapping, and so the ring, is gone before the file is released */
 	WARN_ON(!atomic_xchg(&raw->open_excl, 0));
 	gb_raw_put(raw);
 
 	return 0;
 }
 
+/* Wait for all non-blocking writes to complete */
+static int raw_fsync(struct file *file, loff_t start, loff_t end, int datasync)
+{
+	struct gb_raw *raw = file->private_data;
+	int retval;
+
+	retval = wait_event_interruptible(raw->write_wq, !raw->tx_inflight);
+	if (retval)
+		return retval;
+
+	spin_lock(&raw->tx_lock);
+	retval = raw->tx_error;
+	raw->tx_error = 0;
+	spin_unlock(&raw->tx_lock);
+
+	return retval;
+}
+
 static unsigned int raw_poll(struct file *file,struct poll_table_struct *pll_table)
 {
 	int ret = 0;
 	struct gb_raw *raw = file->private_data;
 
 	poll_wait(file, &raw->read_wq, pll_table);
-	if (!list_empty(&raw->list))
+	poll_wait(file, &raw->write_wq, pll_table);
+	mutex_lock(&raw->list_lock);
+	mutex_lock(&raw->ring_lock);
+	if (raw->ring) {
+		ring_fill(raw);
+		if (raw->ring_head != READ_ONCE(raw->ring->tail))
+			ret |= POLLIN;
+	} else if (!list_empty(&raw->list)) {
 		ret |= POLLIN;
+	}
+	mutex_unlock(&raw->ring_lock);
+	mutex_unlock(&raw->list_lock);
+	spin_lock(&raw->tx_lock);
+	if (raw->tx_error)
+		ret |= POLLERR;
+	if (raw->tx_inflight < raw->tx_window)
+		ret |= POLLOUT | POLLWRNORM;
+	spin_unlock(&raw->tx_lock);
+
 	if (raw->state == GB_RAW_DESTROYED)
 		ret |= POLLHUP;
 
 	return ret;
 }
 
+/* A split of the mapping shares the ring */
+static void raw_vm_open(struct vm_area_struct *vma)
+{
+	struct gb_raw *raw = vma->vm_private_data;
+
+	mutex_lock(&raw->ring_lock);
+	raw->ring_maps++;
+	mutex_unlock(&raw->ring_lock);
+}
+
+/* Once the last mapping is gone, reception falls back to the read() queue */
+static void raw_vm_close(struct vm_area_struct *vma)
+{
+	struct gb_raw *raw = vma->vm_private_data;
+	void *mem = NULL;
+
+	mutex_lock(&raw->ring_lock);
+	if (!--raw->ring_maps) {
+		mem = raw->ring;
+		raw->ring = NULL;
+		raw->ring_data = NULL;
+	}
+	mutex_unlock(&raw->ring_lock);
+
+	vfree(mem);
+}
+
+static const struct vm_operations_struct raw_vm_ops = {
+	.open	= raw_vm_open,
+	.close	= raw_vm_close,
+};
+
+/*
+ * Map the shared receive ring: one control page followed by a power of two
+ * sized data area.  Packets still queued for read() are moved into the ring
+ * by the next poll(), read() or received packet; list_lock can't be taken
+ * here as read() holds it while copying to userspace.
+ */
+static int raw_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct gb_raw *raw = file->private_data;
+	unsigned long len = vma->vm_end - vma->vm_start;
+	unsigned long size = len - PAGE_SIZE;
+	void *mem;
+	int retval;
+
+	if (vma->vm_pgoff || len <= PAGE_SIZE)
+		return -EINVAL;
+
+	if (!is_power_of_2(size) || size < RING_MIN_SIZE ||
+	    size > RING_MAX_SIZE)
+		return -EINVAL;
+
+	mutex_lock(&raw->ring_lock);
+	if (raw->ring) {
+		retval = -EBUSY;
+		goto exit;
+	}
+
+	mem = vmalloc_user(len);
+	if (!mem) {
+		retval = -ENOMEM;
+		goto exit;
+	}
+
+	retval = remap_vmalloc_range(vma, mem, 0);
+	if (retval) {
+		vfree(mem);
+		goto exit;
+	}
+	vma->vm_flags |= VM_DONTCOPY | VM_DONTEXPAND;
+	vma->vm_ops = &raw_vm_ops;
+	vma->vm_private_data = raw;
+
+	raw->ring = mem;
+	raw->ring_data = (u8 *)mem + PAGE_SIZE;
+	raw->ring_size = size;
+	raw->ring_head = 0;
+	raw->ring_dropped = 0;
+	raw->ring->size = size;
+	raw->ring_maps = 1;
+exit:
+	mutex_unlock(&raw->ring_lock);
+
+	/* blocked readers now fail with -EBUSY */
+	if (!retval)
+		wake_up(&raw->read_wq);
+	return retval;
+}
+
 static const struct file_operations raw_fops = {
 	.owner		= THIS_MODULE,
 	.write		= raw_write,
 	.read		= raw_read,
+#ifdef FILE_OPS_HAVE_ITER
+	.write_iter	= raw_write_iter,
+	.read_iter	= raw_read_iter,
+#endif
+	.unlocked_ioctl	= raw_ioctl,
+	.compat_ioctl	= raw_ioctl,
 	.open		= raw_open,
 	.llseek		= noop_llseek,
 	.release	= raw_release,
 	.poll		= raw_poll,
+	.fsync		= raw_fsync,
+	.mmap		= raw_mmap,
 };
 
 static int raw_init(void)
@@ -0,0 +1,73 @@
+/*
+ * Greybus driver for the Raw protocol, userspace interface
+ *
+ * Copyright 2015 Google Inc.
+ * Copyright 2015 Linaro Ltd.
+ *
+ * Released under the GPLv2 only.
+ */
+#ifndef __RAW_H
+#define __RAW_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/*
+ * Shared receive ring.
+ *
+ * Mapping the gbraw character device at offset 0 switches reception from the
+ * read() queue to a ring shared with userspace.  The mapping is one page of
+ * struct gb_raw_ring_ctrl followed by the data area, whose size must be a
+ * power of two.  Packets already queued for read() are moved into the ring
+ * by the next poll(), read() or packet received.  There is one ring at a
+ * time: mmap() fails with -EBUSY until every mapping of the previous ring is
+ * gone, which frees it and sends packets to the read() queue again.
+ *
+ * Every packet is stored as a struct gb_raw_ring_hdr followed by its data,
+ * padded to GB_RAW_RING_ALIGN bytes.  A record never wraps: when it does not
+ * fit before the end of the data area the kernel writes a header with len set
+ * to GB_RAW_RING_WRAP and continues at the start of the area.
+ *
+ * head and tail are free running byte counters, taken modulo size to get an
+ * offset.  The kernel advances head after a record is complete, userspace
+ * advances tail once it is done with a record.  Packets that do not fit are
+ * dropped and counted in dropped.  poll() reports POLLIN while head != tail.
+ */
+struct gb_raw_ring_ctrl {
+	__u32	head;		/* written by the kernel */
+	__u32	size;		/* size of the data area in bytes */
+	__u32	dropped;	/* packets dropped because the ring was full */
+	__u32	reserved0[13];
+	__u32	tail;		/* written by userspace */
+	__u32	reserved1[15];
+};
+
+struct gb_raw_ring_hdr {
+	__u32	len;
+	__u32	reserved;
+	__u8	data[0];
+};
+
+#define GB_RAW_RING_ALIGN		8
+#define GB_RAW_RING_WRAP		0xffffffff
+#define GB_RAW_RING_REC_SIZE(len)					\
+	(((len) + sizeof(struct gb_raw_ring_hdr) + GB_RAW_RING_ALIGN - 1) &	\
+	 ~(GB_RAW_RING_ALIGN - 1))
+
+/*
+ * Framed reads.
+ *
+ * With GB_RAW_IOC_SET_FRAMED set to a non-zero value, read() returns as many
+ * whole packets as fit in the buffer, each one as a struct gb_raw_frame_hdr
+ * followed by its data with no padding.  It fails with -ENOSPC only if the
+ * first packet does not fit.
+ */
+struct gb_raw_frame_hdr {
+	__u32	len;
+	__u8	data[0];
+};
+
+#define GB_RAW_IOC_MAGIC		'r'
+#define GB_RAW_IOC_SET_FRAMED		_IOW(GB_RAW_IOC_MAGIC, 0, __u32)
+
+#endif /* __RAW_H */